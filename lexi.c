@@ -7,21 +7,77 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /*** defines ***/
 
 #define LEXI_VERSION "0.0.1"
 #define LEXI_TAB_STOP 8
 #define LEXI_QUIT_TIMES 3
+#define LEXI_LEAF_ROWS 64 // rows held by one leaf of the text buffer
+#define LEXI_NODE_KIDS 32 // children of one internal node of the text buffer
+#define LEXI_INDEX_CHUNK (4 * 1024 * 1024) // bytes the loader splits into rows per batch
+#define LEXI_LOAD_FIRST (64 * 1024)       // bytes in the loader's first batch, enough for a screen
+#define LEXI_DIFF_GAP 8 // unchanged cells shorter than this are rewritten rather than jumped over
+#define LEXI_RENDER_CACHE 256 // rows whose tab-expanded render is kept around
+#define LEXI_COL_STEP 4096    // bytes between the column marks of a long row
+#define LEXI_LONG_ROW (1 << 16) // rows this long are drawn a window at a time and not colored
+#define LEXI_HL_LOOKBACK 256      // rows lexed above a row whose comment state is unknown
+#define LEXI_HL_PROPAGATE 100000  // rows re-lexed after an edit before giving up on the rest
+#define LEXI_ARENA_SIZE (1 << 20) // load arenas are carved from blocks of this size
+#define LEXI_SLAB_PAGE (1 << 16)  // slab classes are carved from pages of this size
+#define LEXI_SLAB_MIN 16          // smallest slab class, the classes double up to 4K
+#define LEXI_SLAB_CLASSES 9
+#define LEXI_UNDO_BLOCK (1 << 16)        // undo text is kept in blocks of at least this size
+#define LEXI_UNDO_LIMIT (64 * 1024 * 1024) // memory the undo log may use, LEXI_UNDO_MB overrides it
+#define LEXI_JOURNAL_MS 200            // how often the journal writer takes the batched records
+#define LEXI_JOURNAL_COMPACT (1 << 20) // journal bytes past its last compacted size that start another compaction
+#define LEXI_JOURNAL_FOLD 256          // records compaction looks back over for one to fold a record into
+#define LEXI_PASTE_CHUNK (1 << 16) // bytes read at a time while a paste streams in
+#define LEXI_PASTE_WAIT 20         // read timeouts (tenths of a second) before giving up on a paste's end
+#define LEXI_KEY_WAIT 100 // ms to wait for the rest of an escape sequence or a terminal reply
+#define LEXI_STREAM_WAIT 50 // ms to wait for more rows from a pipe before carrying on without them
+#define LEXI_FRAME_MS 8   // at most one frame per this many ms, keys arriving in between share a frame
+#define LEXI_HIST_BUCKETS 256 // four per power of two up to 2^64
+#define LEXI_IOV_BATCH 1024 // pieces handed to one writev when saving or drawing
+#define LEXI_IOV_MIN 32     // runs of screen text at least this long are written from the frame, not copied
+#define LEXI_FOLLOW_CHUNK (16 * 1024 * 1024) // bytes of a followed file read at a time
+#define LEXI_FOLLOW_MS 250 // how often a followed file is checked without inotify
+#define LEXI_SEARCH_CHUNK 256 // leaves scanned by a search worker at a time
+#define LEXI_SEARCH_THREADS 16
+#define LEXI_REGEX_CACHE 8     // compiled patterns kept around while searching
+#define LEXI_REGEX_NODES 100000 // NFA instructions a pattern may compile to
+#define LEXI_REGEX_REPEAT 1000  // largest {n,m} count
+#define LEXI_DFA_STATES 1024    // DFA states a worker keeps per pattern before starting over
+#define LEXI_REGEX_TRACE 4096   // bytes of each longest match scan remembered for later scans of the line
+#define LEXI_SCROLL_MAX 2 // scroll the terminal when at most screenrows / LEXI_SCROLL_MAX new rows come into view
 #define CTRL_KEY(k) ((k)&0x1f)
 enum editorKey
 {
@@ -34,41 +90,617 @@ enum editorKey
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START // the terminal is about to send a bracketed paste
 };
 
+enum allocOp
+{
+  ALLOC_LOAD = 0, // reading the file into rows
+  ALLOC_EDIT,     // changing the text of rows
+  ALLOC_FRAME,    // building the output of a frame
+  ALLOC_OPS
+};
+
+enum statStage
+{
+  STAT_INPUT = 0, // decoding a key once its first byte is in
+  STAT_EDIT,      // acting on the key
+  STAT_SCROLL,    // editorScroll
+  STAT_DRAW,      // filling the frame
+  STAT_DIFF,      // turning the frame into escape sequences
+  STAT_WRITE,     // the write to the terminal
+  STAT_FRAME,     // all of editorRefreshScreen
+  STAT_BYTES,     // bytes written per frame rather than ns
+  STAT_COUNT
+};
+
+enum screenAttr
+{
+  ATTR_NORMAL = 0,
+  ATTR_INVERSE,
+  ATTR_COMMENT, // syntax colors double as cell attributes
+  ATTR_KEYWORD1,
+  ATTR_KEYWORD2,
+  ATTR_STRING,
+  ATTR_NUMBER
+};
+
+enum reTree
+{
+  RT_SET = 0, // one byte out of a set
+  RT_CAT,
+  RT_ALT,
+  RT_REPEAT,
+  RT_BOL,
+  RT_EOL,
+  RT_EMPTY
+};
+
+enum reOp
+{
+  RO_SET = 0, // read a byte in the set and go to out
+  RO_SPLIT,   // go to both out and out1
+  RO_BOL,     // go to out at the beginning of the line
+  RO_EOL,     // go to out at the end of the line
+  RO_MATCH
+};
+
+enum journalOp
+{
+  J_INSERT = 1, // n bytes go into row y at a
+  J_DELETE,     // n bytes of row y go from a
+  J_ROW_INSERT, // a row of n bytes goes in at y
+  J_ROW_DELETE  // n rows go from y
+};
+
+enum undoKind
+{
+  UNDO_INSERT = 0, // text went in at (y, x) and now ends at (ey, ex)
+  UNDO_DELETE,     // text that spanned (y, x) to (ey, ex) was taken out
+  UNDO_REPLACE     // the start of text was swapped for the rest, which now spans (y, x) to (y, ex)
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
 /*** data ***/
 
 typedef struct editor_row
 {
-  int size;
-  int rsize;
+  long long size;
+  long long cap; // bytes owned by chars, 0 if it views the mapping or a load arena
+  int mapped; // chars is a view into the mmapped file, copied on first edit
+  signed char hl_end; // lexer state at the end of the row, -1 until lexed
   char *chars;
-  char *render;
+  int rslot;      // render cache slot holding this row's render, -1 if none
+  unsigned rgen;  // generation of that slot when it was filled for this row
 } editor_row; // stores a line of text as a pointer
 
+typedef struct buffer_node
+{
+  int leaf;                        // leaves hold rows, internal nodes hold children
+  int n;                           // rows (leaf) or children (internal) in use
+  long long nrows;                 // total rows in this subtree
+  long long nbytes;                // bytes those rows take in the saved file, newlines included
+  editor_row *rows;                // leaf only, LEXI_LEAF_ROWS slots, NULL until a mapped leaf is loaded
+  size_t mapoff;                   // mapped leaf: offset of its first line in the file
+  size_t mapend;                   // mapped leaf: offset just past its last line
+  struct buffer_node **kids;       // internal only, LEXI_NODE_KIDS slots
+  struct buffer_node *prev, *next; // leaves are chained for sequential walks
+} buffer_node;                     // node of the B+ tree that holds every row
+
+struct col_mark
+{
+  long long cx, rx; // a chars index and the render column it starts at
+};
+
+struct render_slot
+{
+  unsigned gen; // bumped whenever the slot is emptied or changes owner
+  int used;     // second chance for the clock sweep
+  int rendered; // render and hl hold the row, a long row may have only marks
+  struct col_mark *marks; // every LEXI_COL_STEP bytes of a long row, marks[0] is column 0
+  long long nmarks;       // marks still valid, later ones are rebuilt on demand
+  long long markcap;
+  long long rsize;
+  long long cap;
+  char *render;
+  unsigned char *hl; // colors of render, cap bytes
+  int hl_start;      // lexer state hl was worked out from, -1 if not yet
+};
+
+struct screen_frame
+{
+  int rows, cols;
+  char *chars;          // one byte per cell, row by row
+  unsigned char *attrs; // screenAttr of each cell
+};
+
+struct append_buffer
+{ // acts as a dynamic string, kept from frame to frame
+  char *b;
+  int len;
+  int cap;
+  struct iovec *iov; // what to write: runs of b (with a NULL base until written) and text referenced in place
+  int niov;
+  int iovcap;
+  int mark;  // bytes of b already covered by iov
+  int total; // bytes all the pieces add up to
+};
+
+struct search_match
+{
+  long long row;
+  long long col;
+  long long len;
+};
+
+struct re_tree // parsed search pattern
+{
+  int kind;
+  int min, max;          // RT_REPEAT bounds, max is -1 when unbounded
+  unsigned char set[32]; // RT_SET bytes, one bit each
+  struct re_tree *a, *b;
+};
+
+struct re_node // instruction of a Thompson NFA
+{
+  int op;
+  int out, out1; // next instructions, out1 is only used by RO_SPLIT
+  unsigned char set[32];
+};
+
+struct re_prog
+{
+  struct re_node *nodes;
+  int n, cap;
+  int start;
+  int full; // ran past LEXI_REGEX_NODES
+};
+
+struct dfa_state
+{
+  int n;
+  int *set;       // NFA instructions, each times two plus whether a byte was consumed
+  int accept;     // a match ends here
+  int accept_eol; // a match ends here if this is the end of the line
+  short next[256]; // state after each byte, -1 until first taken
+};
+
+struct dfa_trace // the state a longest match scan was in after the byte at pos
+{
+  long long pos;
+  unsigned long long scan; // which scan left it
+  int state;
+};
+
+struct dfa // lazily built DFA, owned by one search worker
+{
+  struct re_prog *prog;
+  int unanchored; // matches may start anywhere, but only nonempty ones are accepted
+  struct dfa_state **states;
+  int nstates;
+  int *table;      // hash of the states' sets, index + 1 or 0
+  int start[2];    // start state mid line and at the beginning of a line, -1 until built
+  unsigned *mark;  // closure walks stamp the instructions they visited
+  unsigned gen;
+  unsigned flushes;
+  int *stack;
+  int *list;
+  struct dfa_trace *trace;     // longest match DFA only: LEXI_REGEX_TRACE entries by pos
+  unsigned long long scans;    // longest match scans so far
+  unsigned long long valid;    // trace entries left by scans before this one are stale
+  long long tracelast;         // the longest end the valid entries lead to
+  unsigned char *starts;       // backwards DFA only: bit per byte of the line, set where a match starts
+  long long startscap;         // bytes of starts
+  int startsline;              // starts holds the current line
+};
+
+struct regex
+{
+  char *pattern;
+  struct re_prog fwd, rev; // the pattern and the pattern read backwards
+  struct dfa *dfas;        // three per search worker: find a match, mark where matches start, on to the longest end
+  unsigned used;           // last use, for the cache eviction
+};
+
+struct search_chunk
+{
+  buffer_node *leaf;            // first leaf of the chunk
+  int nleaves;
+  long long row;                   // first row of the chunk
+  struct search_match *matches; // matches found in the chunk, in buffer order
+  long long nmatches;
+  long long cap;
+  int done; // set by the worker that scanned it, under the search lock
+};
+
+struct search_state
+{
+  const char *(*kernel)(const char *s, const char *end, const char *q, size_t qlen); // finds the first match in [s, end)
+  char *query;
+  size_t qlen;
+  int regex;                // the query is a pattern, toggled with Ctrl-R in the prompt
+  int replace;              // the prompt asks what to replace rather than what to find
+  struct regex *re;         // compiled query, NULL when it is matched literally
+  const char *regex_err;    // why the query does not compile
+  struct regex *regexes[LEXI_REGEX_CACHE];
+  unsigned regex_clock;
+  struct search_chunk *chunks;
+  char *ready; // chunks whose results the main thread has picked up
+  int nchunks;
+  int chunkcap;
+  int origin;    // chunk the workers start from
+  int next;      // chunks handed out so far
+  int ndone;     // chunks finished by the workers
+  int nready;    // chunks picked up by the main thread
+  unsigned gen;  // bumped to cancel the running search
+  int busy;      // workers in the middle of a chunk
+  int nworkers;
+  int wake[2];   // workers write a byte here when a chunk is done
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t idle;
+  long long origin_row, origin_col; // where the cursor was when the search began
+  int shown;                  // the nearest match has been moved to
+  int partial;                // started before the file was loaded, runs again once it is
+  char prompt[96];            // find prompt, updated with the match count
+};
+
+struct row_storage
+{
+  char *arenas; // every load arena, chained through their first bytes
+  char *arena;  // load arena being filled
+  size_t arena_used;
+  size_t arena_size;
+  char *freelist[LEXI_SLAB_CLASSES]; // freed slab blocks of each size class
+  char *slab;                        // slab page being carved
+  int slab_used;
+};
+
+struct load_state
+{
+  int active;        // rows are still coming from the loader thread
+  pthread_t thread;
+  int fd;            // file read into arena blocks, -1 when indexing the mapping
+  int wake[2];       // the loader writes a byte here after each batch
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // signalled after each batch
+  buffer_node *first, *last; // handed over leaves not yet in the tree, chained through next
+  char *arenas;      // arena blocks their rows live in
+  long long bytes;   // file bytes those leaves hold
+  long long allocs;  // system allocations made for them
+  int done;          // nothing comes after the leaves handed over
+  int stream;        // fd is a pipe or the like, which may stay quiet for any time
+  int cancel;
+  long long total;   // bytes to load, 0 if not known up front
+  long long loaded;  // bytes in the tree so far
+  // the rest belongs to the loader thread
+  buffer_node *bfirst, *blast; // batch being built
+  char *barenas;
+  long long bbytes, ballocs;
+  size_t pos;        // next byte of the mapping to index
+  char *block;       // arena block being read into
+  size_t used, filled, size;
+  long long off;     // bytes up to the last newline read
+  char *partial;     // row text of a last line without a newline
+};
+
+struct follow_state
+{
+  int on;
+  int fd;         // the followed file, kept open so a rename does not lose its last lines
+  int ifd;        // inotify instance watching it, -1 when checking every LEXI_FOLLOW_MS
+  dev_t dev;      // identity of the file behind fd, to notice it being replaced
+  ino_t ino;
+  long long off;  // file offset just past the last complete line in the buffer
+  char *partial;  // text of the last row while its line has no newline yet, NULL if none
+  int more;       // a chunk was read and more is waiting
+  int retry;      // rows could not be added yet, look again later
+};
+
+struct undo_block
+{
+  struct undo_block *next;
+  long long size, used;
+  char data[];
+};
+
+struct undo_entry
+{
+  int kind;
+  int back;                 // deleted by backspace, text is stored last byte first
+  unsigned long long group; // entries of one group are undone and redone together
+  long long y, x;
+  long long ey, ex;
+  char *text;
+  long long len;
+  struct undo_block *block; // the block text is in
+};
+
+struct undo_state
+{
+  struct undo_entry *entries;
+  long long n, cap;
+  long long done;                  // entries[done..n) can be redone
+  struct undo_block *first, *last; // text of the entries, oldest first
+  long long bytes;                 // blocks allocated for text
+  long long limit;                 // text blocks plus entries are kept under this
+  unsigned long long group;        // group of the newest entry
+  int nest;                        // undoBegin calls not yet ended, their edits share a group
+  int open;                        // the newest entry may still grow by a typed or deleted byte
+  int replaying;                   // edits come from undo or redo and are not recorded
+};
+
+struct journal_rec
+{
+  int op;
+  long long y, a, n;
+  char *text; // J_INSERT and J_ROW_INSERT
+};
+
+struct journal_buf
+{
+  char *b;
+  long long len, cap;
+};
+
+struct journal_header
+{
+  char magic[8];
+  long long pid;        // the lexi writing it
+  long long pid_start;  // when it started, in ticks after boot, to tell a reused pid apart; 0 if unknown
+  char boot[40];        // the kernel's boot_id when it was written, empty if unknown
+  long long size;       // the file the records apply to, as it was opened or last saved
+  long long mtime, mtime_ns;
+  long long ino;
+};
+
+struct journal_state
+{
+  int on;        // a journal is open and its writer running
+  int failed;    // it could not be created or belongs to another lexi, do not try on every edit
+  int replaying; // edits come from the journal and are not recorded again
+  int error;     // errno of a write the writer could not finish, under the lock
+  int fd;
+  char *path;
+  struct journal_header base;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  struct journal_buf batch; // encoded records the writer has not taken yet
+  struct journal_rec last;  // newest record, still open to typing on it
+  long long lastcap;        // bytes allocated for last.text
+  long long written;        // size of the journal on disk, writer only
+  long long compacted;      // its size after the last compaction, writer only
+};
+
+struct alloc_stats
+{
+  long long calls[ALLOC_OPS]; // calls that reached malloc or realloc
+  long long ops[ALLOC_OPS];   // rows loaded, row edits and frames drawn
+};
+
+struct editor_syntax
+{
+  char *filetype;
+  char **filematch; // extensions starting with a dot, or whole file names
+  char **keywords;
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
+};
+
+struct histogram
+{
+  unsigned long long count;
+  unsigned long long max;
+  unsigned long long buckets[LEXI_HIST_BUCKETS];
+};
+
 struct editorConfig
 {
-  int cursor_x, cursor_y; // cursor x and y
-  int rx;
-  int rowoff; // for vertical scrolling
-  int coloff; // for horizontal scrolling
+  long long cursor_x, cursor_y; // cursor x and y
+  long long rx;
+  long long rowoff; // for vertical scrolling
+  long long coloff; // for horizontal scrolling
   int screenrows;
   int screencols;
-  int numrows;
-  editor_row *row; // pointer to editor_row
+  long long numrows;
+  buffer_node *buf; // root of the tree of rows
+  struct render_slot *rcache; // renders of rows with tabs, shared by whatever is on screen
+  int rcache_size;
+  int rcache_hand;
+  char *window; // visible part of a long row, expanded for drawing
+  long long window_cap;
+  char *map;        // file contents when opened through mmap
+  size_t maplen;
+  size_t mapindexed; // bytes of the mapping already split into rows
+  struct search_state search;
+  struct editor_syntax *syntax; // NULL when the file type is not known
+  struct row_storage store;
+  struct alloc_stats alloc;
+  struct load_state load;
+  struct follow_state follow;
+  struct undo_state undo;
+  struct journal_state journal;
+  int redraw; // rows came in since the last frame
   int dirty;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct termios orig_termios;
+  char *input;   // bytes read past the end of a paste, handed out before reading the terminal again
+  int inputlen;
+  int inputpos;
+  struct screen_frame frame;  // frame being composed
+  struct screen_frame shadow; // what the terminal currently shows
+  struct append_buffer out;   // output of the frame being drawn
+  int shadow_valid;           // 0 forces the next frame to repaint everything
+  long long shadow_rowoff;     // offsets the shadow frame was drawn at
+  long long shadow_coloff;
+  int sync_output;            // terminal supports synchronized output
+  int term_cx, term_cy;       // where the terminal cursor is after the last write, -1 if unknown
+  int frame_bytes;            // bytes written by the last frame
+  long long frame_time;       // editorNow() when the last frame was drawn
+  long long total_bytes;      // bytes written by all frames so far
+  struct histogram stats[STAT_COUNT];
+  int stats_overlay;          // show the stage timings in the message bar
+  long long edit_start;       // statBegin() for the key being handled, restarted by each key a prompt reads
+  int readonly;               // a pager: keys that would edit are refused (lexi -R)
+  char *stats_file;           // where to dump the histograms on exit, NULL to not keep them
 };
 struct editorConfig E;
 
+#ifdef LEXI_BENCH
+struct bench_state
+{
+  int rows, cols;     // size of the null terminal
+  long long *lat;     // us from reading each key to reading the next one
+  int nlat;
+  int latcap;
+  long long keystart; // when the key being handled was read
+};
+struct bench_state Bench;
+#endif
+
+/*** filetypes ***/
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "do", "goto", "sizeof", "#include", "#define", "#ifdef", "#ifndef", "#endif",
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "const|", "size_t|", NULL};
+
+char *CONF_HL_extensions[] = {".conf", ".cfg", ".ini", ".toml", ".yaml", ".yml",
+                              ".sh", ".py", "Makefile", NULL};
+char *CONF_HL_keywords[] = {
+    "if", "then", "else", "elif", "fi", "for", "while", "do", "done", "case",
+    "esac", "in", "return", "def", "import", "from", "class", "export",
+    "true|", "false|", "yes|", "no|", "on|", "off|", "True|", "False|", "None|", NULL};
+
+struct editor_syntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"conf", CONF_HL_extensions, CONF_HL_keywords, "#", NULL, NULL,
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 /*** prototypes ***/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int)); // takes a callback function as argument 
+int editorIndexing();
+int editorIndexWait();
+int editorIndexPublish(int wait);
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int empty_ok); // takes a callback function as argument 
+void *searchWorker(void *arg);
+void regexFree(struct regex *re);
+int searchRunning();
+void searchPoll();
+void searchCancel();
+void searchStart(const char *query, long long row, long long col);
+long long editorLastCursorY();
+void followPoll();
+void followStop();
+int followAttach();
+struct col_mark editorRowMark(editor_row *row, long long key, int by_rx);
+void undoRecord(int kind, long long y, long long x, long long ey, long long ex, const char *text, long long len);
+void undoBegin();
+void undoEnd();
+void undoClear();
+void journalRecord(int op, long long y, long long a, long long n, const char *text);
+void journalClose(int discard);
+long long editorColumns(const char *s, long long from, long long to, long long rx);
+#ifdef LEXI_BENCH
+void benchKey();
+#endif
+int editorDecodeKey(char c);
+/*** stats ***/
+
+// Each stage of handling a key and drawing a frame can be timed into a
+// histogram with four buckets per power of two, which is enough for a
+// p50/p99 without keeping samples. Timing only happens while the overlay
+// (Ctrl-P) is up or LEXI_STATS names a file to dump the histograms to on
+// exit; otherwise a stage costs one branch.
+
+long long statNow() // monotonic clock in ns
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long statBegin()
+{
+  return (E.stats_overlay || E.stats_file) ? statNow() : 0;
+}
+
+void statAdd(int stage, unsigned long long v)
+{
+  struct histogram *h = &E.stats[stage];
+  int b = v;
+  if (v >= 4)
+  {
+    int lg = 63 - __builtin_clzll(v);
+    b = lg * 4 + ((v >> (lg - 2)) & 3);
+  }
+  h->buckets[b]++;
+  h->count++;
+  if (v > h->max)
+    h->max = v;
+}
+
+void statEnd(int stage, long long start)
+{
+  if (start)
+    statAdd(stage, statNow() - start);
+}
+
+unsigned long long statBucketLow(int b)
+{
+  return b < 4 ? (unsigned long long)b : (4ULL + (b & 3)) << (b / 4 - 2);
+}
+
+unsigned long long statPercentile(int stage, double p) // lower edge of the bucket holding the p-th sample
+{
+  struct histogram *h = &E.stats[stage];
+  unsigned long long want = p * h->count, seen = 0;
+  int b;
+  for (b = 0; b < LEXI_HIST_BUCKETS; b++)
+  {
+    seen += h->buckets[b];
+    if (seen > want)
+      return statBucketLow(b);
+  }
+  return h->max;
+}
+
+void statDump() // writes every histogram to $LEXI_STATS, called at exit
+{
+  static const char *names[STAT_COUNT] = {"input", "edit", "scroll", "draw", "diff", "write", "frame", "frame_bytes"};
+  FILE *fp = fopen(E.stats_file, "w");
+  if (fp == NULL)
+    return;
+  int s, b;
+  for (s = 0; s < STAT_COUNT; s++)
+  {
+    struct histogram *h = &E.stats[s];
+    fprintf(fp, "stage %s count %llu p50 %llu p99 %llu max %llu\n", names[s], h->count,
+            statPercentile(s, 0.5), statPercentile(s, 0.99), h->max);
+    for (b = 0; b < LEXI_HIST_BUCKETS; b++)
+      if (h->buckets[b])
+        fprintf(fp, "bucket %s %llu %llu\n", names[s], statBucketLow(b), h->buckets[b]);
+  }
+  fclose(fp);
+}
+
 /*** terminal ***/
 
 // Terminal starts in canonical mode by default (Input sent only when enter is pressed)
@@ -84,6 +716,7 @@ void die(const char *s)
 
 void disableRawMode()
 {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) // tcsetattr() for setting terminal attributes
     die("tcsetattr");
 }
@@ -99,34 +732,149 @@ void enableRawMode()
   raw.c_oflag &= ~(OPOST);                                  // disable all output processing (output flags) (\n to \r\n translation)
   raw.c_cflag |= (CS8);                                     // 8-bit chars
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);          // disable echo, canonical input, extended input, and signal processing i.e. ctrl+C, ctrl+Z (defined in termios.h)
-  raw.c_cc[VMIN] = 0;                                       // minimum number of characters to read before returning
-  raw.c_cc[VTIME] = 1;                                      // timeout in deciseconds before returning
+  raw.c_cc[VMIN] = 0;                                       // read never blocks, waiting is done with poll
+  raw.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+  write(STDOUT_FILENO, "\x1b[?2004h", 8); // bracketed paste, so a paste arrives as one block instead of keystrokes
+}
+int editorTakeStdin() // moves piped input off stdin, where the terminal goes for the keys; returns its fd
+{
+  int fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR);
+  if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+    die("/dev/tty");
+  close(tty);
+  return fd;
+}
+
+int editorInputPending()
+{
+  if (E.inputpos < E.inputlen)
+    return 1;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+long long editorNow() // monotonic clock in ms
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int editorReadTimeout(char *c, int ms) // reads one byte from the terminal, 0 if none arrives within ms
+{
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  if (poll(&pfd, 1, ms) <= 0)
+    return 0;
+  return read(STDIN_FILENO, c, 1);
+}
+
+int editorReadByte(char *c)
+{
+  if (E.inputpos < E.inputlen)
+  {
+    *c = E.input[E.inputpos++];
+    return 1;
+  }
+  return editorReadTimeout(c, LEXI_KEY_WAIT);
+}
+
+int editorWaitInput(int ms) // sleeps until a key arrives, search results come in or ms pass; true if a key is there
+{
+  struct follow_state *f = &E.follow;
+  int wait = !f->on ? -1 : f->more ? 0 : (f->ifd == -1 || f->retry) ? LEXI_FOLLOW_MS : -1;
+  if (E.redraw) // new rows are shown at the frame rate, not once per batch
+  {
+    long long due = E.frame_time + LEXI_FRAME_MS - editorNow();
+    if (wait < 0 || due < wait)
+      wait = due < 0 ? 0 : due;
+  }
+  if (wait >= 0 && (ms < 0 || wait < ms))
+    ms = wait;
+  struct pollfd pfds[4] = {{STDIN_FILENO, POLLIN, 0},
+                           {E.search.wake[0], POLLIN, 0},
+                           {f->on ? f->ifd : -1, POLLIN, 0},
+                           {E.load.active ? E.load.wake[0] : -1, POLLIN, 0}};
+  int ready = poll(pfds, 4, ms);
+  if (pfds[3].revents & POLLIN)
+    editorIndexPublish(0);
+  if (f->on && (ready == 0 || f->more || (pfds[2].revents & POLLIN)))
+    followPoll();
+  if (E.redraw && editorNow() >= E.frame_time + LEXI_FRAME_MS)
+    editorRefreshScreen();
+  if (ready <= 0)
+    return 0;
+  if (pfds[1].revents & POLLIN)
+  {
+    if (searchRunning())
+    {
+      searchPoll();
+    }
+    else
+    {
+      char drain[64]; // wakeups from a search that was cancelled
+      while (read(E.search.wake[0], drain, sizeof(drain)) > 0)
+        ;
+    }
+  }
+  return (pfds[0].revents & POLLIN) != 0;
 }
+
 int editorReadKey() // read key from terminal
 {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+#ifdef LEXI_BENCH
+  benchKey();
+#endif
+  while (1)
   {
-    if (nread == -1 && errno != EAGAIN)
+    if (E.inputpos < E.inputlen)
+    {
+      c = E.input[E.inputpos++];
+      break;
+    }
+#ifdef LEXI_BENCH
+    return '\x1b'; // the script is over: leave any prompt it ended in
+#endif
+    if (!editorWaitInput(-1)) // nothing to do until the user types or a search reports back
+      continue;
+    if ((nread = read(STDIN_FILENO, &c, 1)) == 1)
+      break;
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
       die("read");
   }
+  long long start = statBegin();
+  int key = editorDecodeKey(c);
+  statEnd(STAT_INPUT, start);
+  return key;
+}
+
+int editorDecodeKey(char c) // turns an escape sequence starting with c into a key
+{
   if (c == '\x1b')
   {
     char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
+    if (editorReadByte(&seq[0]) != 1)
       return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
+    if (editorReadByte(&seq[1]) != 1)
       return '\x1b';
     if (seq[0] == '[')
     {
       if (seq[1] >= '0' && seq[1] <= '9')
       {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
+        if (editorReadByte(&seq[2]) != 1)
           return '\x1b';
+        if (seq[1] == '2' && seq[2] == '0') // \x1b[200~ starts a paste, a stray \x1b[201~ is dropped
+        {
+          char end[2];
+          if (editorReadByte(&end[0]) != 1 || editorReadByte(&end[1]) != 1)
+            return '\x1b';
+          return (end[0] == '0' && end[1] == '~') ? PASTE_START : '\x1b';
+        }
         if (seq[2] == '~')
         {
           switch (seq[1])
@@ -193,7 +941,7 @@ int getCursorPosition(int *rows, int *cols)
     return -1;
   while (i < sizeof(buf) - 1)
   {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
+    if (editorReadTimeout(&buf[i], LEXI_KEY_WAIT) != 1)
       break;
     if (buf[i] == 'R')
       break;
@@ -208,8 +956,37 @@ int getCursorPosition(int *rows, int *cols)
   return 0;
 }
 
+int getSyncOutputSupport()
+{
+  // asks whether synchronized output (mode 2026) is known, followed by a
+  // primary device attributes query that every terminal answers, so the
+  // reply to the first question is either there before it or never comes
+#ifdef LEXI_BENCH
+  return 0;
+#endif
+  char buf[64];
+  unsigned int i = 0;
+  if (write(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 12) != 12)
+    return 0;
+  while (i < sizeof(buf) - 1)
+  {
+    if (editorReadTimeout(&buf[i], LEXI_KEY_WAIT) != 1)
+      break;
+    if (buf[i] == 'c')
+      break;
+    i++;
+  }
+  buf[i] = '\0';
+  return strstr(buf, "\x1b[?2026;1$y") != NULL || strstr(buf, "\x1b[?2026;2$y") != NULL;
+}
+
 int getWindowSize(int *rows, int *cols)
 {
+#ifdef LEXI_BENCH
+  *rows = Bench.rows;
+  *cols = Bench.cols;
+  return 0;
+#endif
   struct winsize ws;
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
   { // Terminal IOCtl(Input/Output Control) Get WINdow SiZe)
@@ -225,344 +1002,4588 @@ int getWindowSize(int *rows, int *cols)
   }
 }
 
-/*** row operations ***/
+/*** row storage ***/
 
-int editorRowCxToRx(editor_row *row, int cursor_x)
+// Row text comes from one of three places. Lines read at load time are
+// packed back to back into large arenas that are never freed one by one.
+// Rows that get edited move into size classed slabs, so typing reuses freed
+// blocks instead of going to malloc, and a row's capacity grows
+// geometrically so a run of keystrokes rarely has to move it. Only rows
+// longer than the biggest class use malloc directly. A row with no
+// capacity does not own its text (it views an arena or the mapping) and is
+// copied into a slab on its first edit.
+
+void *allocCount(void *p, enum allocOp op) // counts calls that reach the system allocator
 {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cursor_x; j++)
+  if (p == NULL)
+    die("malloc");
+  E.alloc.calls[op]++;
+  return p;
+}
+
+char *arenaAlloc(size_t len) // len bytes that live as long as the buffer
+{
+  struct row_storage *st = &E.store;
+  if (st->arena == NULL || st->arena_used + len > st->arena_size)
   {
-    if (row->chars[j] == '\t')
-      rx += (LEXI_TAB_STOP - 1) - (rx % LEXI_TAB_STOP);
-    rx++;
+    st->arena_size = sizeof(char *) + (len > LEXI_ARENA_SIZE ? len : LEXI_ARENA_SIZE);
+    st->arena = allocCount(malloc(st->arena_size), ALLOC_LOAD);
+    memcpy(st->arena, &st->arenas, sizeof(char *));
+    st->arenas = st->arena;
+    st->arena_used = sizeof(char *);
   }
-  return rx;
-} // converts a chars index into a render index
+  char *p = st->arena + st->arena_used;
+  st->arena_used += len;
+  return p;
+}
+
+char *arenaCopy(const char *s, size_t len) // a NUL terminated copy of s that lives as long as the buffer
+{
+  char *p = arenaAlloc(len + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
 
-int editorRowRxToCx(editor_row *row, int rx)
+void arenaFreeAll() // the buffer is going away
 {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++)
+  struct row_storage *st = &E.store;
+  while (st->arenas)
   {
-    if (row->chars[cx] == '\t')
-      cur_rx += (LEXI_TAB_STOP - 1) - (cur_rx % LEXI_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx)
-      return cx;
+    char *next;
+    memcpy(&next, st->arenas, sizeof(char *));
+    free(st->arenas);
+    st->arenas = next;
   }
-  return cx;
+  st->arena = NULL;
+  st->arena_used = st->arena_size = 0;
 }
 
-void editorUpdaterow(editor_row *row)
+char *slabAlloc(long long need, long long *cap) // a block of at least need bytes, its real size goes to *cap
 {
-  // rendering tabs
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
-      tabs++;
-  free(row->render);
-  row->render = malloc(row->size + tabs * (LEXI_TAB_STOP - 1) + 1);
-  int idx = 0;
-  for (j = 0; j < row->size; j++)
+  struct row_storage *st = &E.store;
+  int c = 0;
+  while (c < LEXI_SLAB_CLASSES && (LEXI_SLAB_MIN << c) < need)
+    c++;
+  if (c == LEXI_SLAB_CLASSES)
   {
-    if (row->chars[j] == '\t')
-    {
-      row->render[idx++] = ' ';
-      while (idx % LEXI_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    }
-    else
-    {
-      row->render[idx++] = row->chars[j];
-    }
+    *cap = need;
+    return allocCount(malloc(need), ALLOC_EDIT);
+  }
+  *cap = LEXI_SLAB_MIN << c;
+  if (st->freelist[c])
+  {
+    char *p = st->freelist[c];
+    memcpy(&st->freelist[c], p, sizeof(char *)); // free blocks hold the next free block of their class
+    return p;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  if (st->slab == NULL || st->slab_used + *cap > LEXI_SLAB_PAGE)
+  {
+    st->slab = allocCount(malloc(LEXI_SLAB_PAGE), ALLOC_EDIT); // the tail of the old page is left unused
+    st->slab_used = 0;
+  }
+  char *p = st->slab + st->slab_used;
+  st->slab_used += *cap;
+  return p;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+void slabFree(char *p, long long cap)
 {
-  if (at < 0 || at > E.numrows)
+  struct row_storage *st = &E.store;
+  if (cap > LEXI_SLAB_MIN << (LEXI_SLAB_CLASSES - 1))
+  {
+    free(p);
     return;
-  E.row = realloc(E.row, sizeof(editor_row) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(editor_row) * (E.numrows - at));
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdaterow(&E.row[at]);
-  E.numrows++;
-  E.dirty++;
+  }
+  int c = 0;
+  while ((LEXI_SLAB_MIN << c) < cap)
+    c++;
+  memcpy(p, &st->freelist[c], sizeof(char *));
+  st->freelist[c] = p;
 }
 
-void editorFreerow(editor_row *row) // frees the memory allocated to an erow
+/*** text buffer ***/
+
+// Rows live in a B+ tree indexed by line number. Leaves hold small arrays of
+// rows and internal nodes only know how many rows and bytes sit below each
+// child, so finding, inserting or deleting a line, or finding the line at a
+// byte offset, costs O(log n) anywhere in the file.
+
+buffer_node *bufNewNode(int leaf)
 {
-  free(row->render);
-  free(row->chars);
+  buffer_node *node = calloc(1, sizeof(buffer_node));
+  if (node == NULL)
+    die("calloc");
+  node->leaf = leaf;
+  if (leaf)
+    node->rows = malloc(sizeof(editor_row) * LEXI_LEAF_ROWS);
+  else
+    node->kids = malloc(sizeof(buffer_node *) * LEXI_NODE_KIDS);
+  if (node->rows == NULL && node->kids == NULL)
+    die("malloc");
+  return node;
 }
-void editorDelRow(int at) //
+
+void bufFreeNode(buffer_node *node)
 {
-  if (at < 0 || at >= E.numrows)
-    return;
-  editorFreerow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(editor_row) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+  free(node->rows);
+  free(node->kids);
+  free(node);
 }
 
-void editorRowDelChar(editor_row *row, int at)
+void bufFreeTree(buffer_node *node) // frees a subtree along with the text its rows own
 {
-  if (at < 0 || at >= row->size)
+  int i;
+  if (node->leaf && node->rows)
+  {
+    for (i = 0; i < node->n; i++)
+      if (node->rows[i].cap)
+        slabFree(node->rows[i].chars, node->rows[i].cap);
+  }
+  else if (!node->leaf)
+  {
+    for (i = 0; i < node->n; i++)
+      bufFreeTree(node->kids[i]);
+  }
+  bufFreeNode(node);
+}
+
+int bufChildAt(buffer_node *node, long long *at) // picks the child holding row *at and makes *at relative to it
+{
+  int i;
+  for (i = 0; i < node->n - 1; i++)
+  {
+    if (*at < node->kids[i]->nrows)
+      break;
+    *at -= node->kids[i]->nrows;
+  }
+  return i;
+}
+
+long long bufCountBytes(buffer_node *node) // recounts a node's bytes from its rows or children
+{
+  long long bytes = 0;
+  int j;
+  for (j = 0; j < node->n; j++)
+    bytes += node->leaf ? node->rows[j].size + 1 : node->kids[j]->nbytes;
+  return bytes;
+}
+
+buffer_node *bufLoadLeaf(buffer_node *leaf) // turns the lines of a mapped leaf into rows viewing the mapping
+{
+  if (leaf->rows)
+    return leaf;
+  editor_row *rows = malloc(sizeof(editor_row) * LEXI_LEAF_ROWS);
+  if (rows == NULL)
+    die("malloc");
+  char *p = E.map + leaf->mapoff;
+  char *end = E.map + E.maplen;
+  int j;
+  for (j = 0; j < leaf->n; j++)
+  {
+    char *nl = memchr(p, '\n', end - p);
+    char *eol = nl ? nl : end;
+    while (eol > p && eol[-1] == '\r')
+      eol--;
+    rows[j].size = eol - p;
+    rows[j].cap = 0;
+    rows[j].mapped = 1;
+    rows[j].hl_end = -1;
+    rows[j].chars = p;
+    rows[j].rslot = -1;
+    p = nl ? nl + 1 : end;
+  }
+  __atomic_store_n(&leaf->rows, rows, __ATOMIC_RELEASE); // search workers may be scanning this leaf
+  return leaf;
+}
+
+buffer_node *bufLeafAt(long long at, int *idx) // finds the leaf holding row `at` and its index inside it
+{
+  buffer_node *node = E.buf;
+  while (!node->leaf)
+    node = node->kids[bufChildAt(node, &at)];
+  *idx = at;
+  return bufLoadLeaf(node);
+}
+
+editor_row *editorRowAt(long long at)
+{
+  int idx;
+  buffer_node *leaf = bufLeafAt(at, &idx);
+  return &leaf->rows[idx];
+}
+
+buffer_node *bufSplit(buffer_node *node) // moves the upper half of a full node into a new right sibling
+{
+  buffer_node *right = bufNewNode(node->leaf);
+  int half = node->n / 2;
+  int j;
+  right->n = node->n - half;
+  node->n = half;
+  if (node->leaf)
+  {
+    memcpy(right->rows, &node->rows[half], sizeof(editor_row) * right->n);
+    node->nrows = node->n;
+    right->nrows = right->n;
+    node->nbytes = bufCountBytes(node);
+    right->nbytes = bufCountBytes(right);
+    right->prev = node;
+    right->next = node->next;
+    if (node->next)
+      node->next->prev = right;
+    node->next = right;
+  }
+  else
+  {
+    memcpy(right->kids, &node->kids[half], sizeof(buffer_node *) * right->n);
+    node->nrows = 0;
+    for (j = 0; j < node->n; j++)
+      node->nrows += node->kids[j]->nrows;
+    right->nrows = 0;
+    for (j = 0; j < right->n; j++)
+      right->nrows += right->kids[j]->nrows;
+    node->nbytes = bufCountBytes(node);
+    right->nbytes = bufCountBytes(right);
+  }
+  return right;
+}
+
+buffer_node *bufNodeInsert(buffer_node *node, long long at, editor_row *row) // returns the new sibling if node had to split
+{
+  buffer_node *split = NULL;
+  buffer_node *target = node;
+  if (node->leaf)
+  {
+    bufLoadLeaf(node);
+    if (node->n == LEXI_LEAF_ROWS)
+    {
+      split = bufSplit(node);
+      if (at > node->n)
+      {
+        at -= node->n;
+        target = split;
+      }
+    }
+    memmove(&target->rows[at + 1], &target->rows[at], sizeof(editor_row) * (target->n - at));
+    target->rows[at] = *row;
+    target->n++;
+    target->nrows++;
+    target->nbytes += row->size + 1;
+    return split;
+  }
+  int i = bufChildAt(node, &at);
+  buffer_node *kid = bufNodeInsert(node->kids[i], at, row);
+  node->nrows++;
+  node->nbytes += row->size + 1;
+  if (kid == NULL)
+    return NULL;
+  if (node->n == LEXI_NODE_KIDS)
+  {
+    split = bufSplit(node); // recounts both halves without the new child
+    if (i >= node->n)
+    {
+      i -= node->n;
+      target = split;
+    }
+  }
+  memmove(&target->kids[i + 2], &target->kids[i + 1], sizeof(buffer_node *) * (target->n - i - 1));
+  target->kids[i + 1] = kid;
+  target->n++;
+  if (split)
+  {
+    target->nrows += kid->nrows;
+    target->nbytes += kid->nbytes;
+  }
+  return split;
+}
+
+void bufInsertRow(long long at, editor_row *row) // takes ownership of the row's contents
+{
+  buffer_node *split = bufNodeInsert(E.buf, at, row);
+  if (split)
+  {
+    buffer_node *root = bufNewNode(0);
+    root->kids[0] = E.buf;
+    root->kids[1] = split;
+    root->n = 2;
+    root->nrows = E.buf->nrows + split->nrows;
+    root->nbytes = E.buf->nbytes + split->nbytes;
+    E.buf = root;
+  }
+}
+
+void bufMerge(buffer_node *node, int i) // folds kids[i + 1] into kids[i]
+{
+  buffer_node *left = node->kids[i];
+  buffer_node *right = node->kids[i + 1];
+  if (left->leaf)
+  {
+    bufLoadLeaf(left);
+    bufLoadLeaf(right);
+    memcpy(&left->rows[left->n], right->rows, sizeof(editor_row) * right->n);
+    left->next = right->next;
+    if (right->next)
+      right->next->prev = left;
+  }
+  else
+  {
+    memcpy(&left->kids[left->n], right->kids, sizeof(buffer_node *) * right->n);
+  }
+  left->n += right->n;
+  left->nrows += right->nrows;
+  left->nbytes += right->nbytes;
+  bufFreeNode(right);
+  memmove(&node->kids[i + 1], &node->kids[i + 2], sizeof(buffer_node *) * (node->n - i - 2));
+  node->n--;
+}
+
+long long bufNodeDelete(buffer_node *node, long long at) // returns the bytes the row took
+{
+  long long bytes;
+  node->nrows--;
+  if (node->leaf)
+  {
+    bufLoadLeaf(node);
+    bytes = node->rows[at].size + 1;
+    node->nbytes -= bytes;
+    memmove(&node->rows[at], &node->rows[at + 1], sizeof(editor_row) * (node->n - at - 1));
+    node->n--;
+    return bytes;
+  }
+  int i = bufChildAt(node, &at);
+  buffer_node *kid = node->kids[i];
+  bytes = bufNodeDelete(kid, at);
+  node->nbytes -= bytes;
+  int cap = kid->leaf ? LEXI_LEAF_ROWS : LEXI_NODE_KIDS;
+  if (kid->n < cap / 4 && node->n > 1) // keep nodes from going sparse by folding them into a neighbour
+  {
+    int j = (i + 1 < node->n) ? i : i - 1;
+    if (node->kids[j]->n + node->kids[j + 1]->n <= cap)
+      bufMerge(node, j);
+  }
+  return bytes;
+}
+
+buffer_node *bufNodeAppend(buffer_node *node, buffer_node *leaf) // hangs a leaf off the right edge, returns the new sibling if node had to split
+{
+  buffer_node *split = NULL;
+  buffer_node *target = node;
+  buffer_node *last = node->kids[node->n - 1];
+  buffer_node *kid = last->leaf ? leaf : bufNodeAppend(last, leaf);
+  node->nrows += leaf->nrows;
+  node->nbytes += leaf->nbytes;
+  if (kid == NULL)
+    return NULL;
+  if (node->n == LEXI_NODE_KIDS)
+  {
+    split = bufSplit(node);
+    target = split;
+  }
+  target->kids[target->n++] = kid;
+  if (split)
+  {
+    target->nrows += kid->nrows;
+    target->nbytes += kid->nbytes;
+  }
+  return split;
+}
+
+void bufAppendLeaf(buffer_node *leaf) // adds a whole leaf after the last row in O(log n)
+{
+  buffer_node *last = E.buf;
+  while (!last->leaf)
+    last = last->kids[last->n - 1];
+  if (last == E.buf && last->n == 0)
+  {
+    bufFreeNode(E.buf);
+    E.buf = leaf;
+    return;
+  }
+  last->next = leaf;
+  leaf->prev = last;
+  buffer_node *split = E.buf->leaf ? leaf : bufNodeAppend(E.buf, leaf);
+  if (split)
+  {
+    buffer_node *root = bufNewNode(0);
+    root->kids[0] = E.buf;
+    root->kids[1] = split;
+    root->n = 2;
+    root->nrows = E.buf->nrows + split->nrows;
+    root->nbytes = E.buf->nbytes + split->nbytes;
+    E.buf = root;
+  }
+}
+
+void bufResizeRow(long long at, long long delta) // a row's text grew by delta bytes
+{
+  buffer_node *node = E.buf;
+  while (1)
+  {
+    node->nbytes += delta;
+    if (node->leaf)
+      break;
+    node = node->kids[bufChildAt(node, &at)];
+  }
+}
+
+long long bufByteOfRow(long long at) // offset in the saved file where row `at` starts
+{
+  buffer_node *node = E.buf;
+  long long off = 0;
+  int i, j;
+  while (!node->leaf)
+  {
+    i = bufChildAt(node, &at);
+    for (j = 0; j < i; j++)
+      off += node->kids[j]->nbytes;
+    node = node->kids[i];
+  }
+  bufLoadLeaf(node);
+  for (j = 0; j < at && j < node->n; j++)
+    off += node->rows[j].size + 1;
+  return off;
+}
+
+long long bufRowOfByte(long long off, long long *start) // the row holding byte `off` and where that row starts
+{
+  buffer_node *node = E.buf;
+  long long row = 0;
+  int j;
+  *start = 0;
+  while (!node->leaf)
+  {
+    for (j = 0; j < node->n - 1 && off >= node->kids[j]->nbytes; j++)
+    {
+      off -= node->kids[j]->nbytes;
+      *start += node->kids[j]->nbytes;
+      row += node->kids[j]->nrows;
+    }
+    node = node->kids[j];
+  }
+  bufLoadLeaf(node);
+  for (j = 0; j < node->n - 1 && off >= node->rows[j].size + 1; j++)
+  {
+    off -= node->rows[j].size + 1;
+    *start += node->rows[j].size + 1;
+    row++;
+  }
+  return row;
+}
+
+void bufDeleteRow(long long at) // the caller frees the row's contents first
+{
+  bufNodeDelete(E.buf, at);
+  while (!E.buf->leaf && E.buf->n == 1)
+  {
+    buffer_node *root = E.buf;
+    E.buf = root->kids[0];
+    bufFreeNode(root);
+  }
+}
+
+/*** syntax highlighting ***/
+
+// Highlighting works on one row at a time. The only thing a row needs from
+// the rows above it is whether it starts inside a multi-line comment, so
+// each row keeps the state it ends in. An edit re-lexes rows from the edited
+// one down and stops at the first row whose end state did not change, and
+// colors are only worked out for the rows being drawn, next to their render
+// in the render cache. Rows of LEXI_LONG_ROW bytes or more are not lexed at
+// all: they are drawn plain and pass the comment state through, so typing in
+// a line of many megabytes does not re-lex it on every key.
+
+int is_separator(int c)
+{
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:&|!?^", c) != NULL;
+}
+
+int editorLex(const char *s, long long len, int state, unsigned char *hl) // colors s into hl (if given) and returns its end state
+{
+  struct editor_syntax *syn = E.syntax;
+  const char *scs = syn->singleline_comment_start;
+  const char *mcs = syn->multiline_comment_start;
+  const char *mce = syn->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+  int prev_sep = 1;
+  int in_string = 0;
+  int in_comment = state;
+  unsigned char prev = ATTR_NORMAL;
+  long long i = 0;
+#define HL_MARK(n, a)                \
+  do                                 \
+  {                                  \
+    if (hl)                          \
+      memset(&hl[i], (a), (n));      \
+    prev = (a);                      \
+  } while (0)
+  while (i < len)
+  {
+    char c = s[i];
+    if (scs_len && !in_string && !in_comment && len - i >= scs_len && !strncmp(&s[i], scs, scs_len))
+    {
+      HL_MARK(len - i, ATTR_COMMENT);
+      break;
+    }
+    if (mcs_len && mce_len && !in_string)
+    {
+      if (in_comment)
+      {
+        if (len - i >= mce_len && !strncmp(&s[i], mce, mce_len))
+        {
+          HL_MARK(mce_len, ATTR_COMMENT);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+        }
+        else
+        {
+          HL_MARK(1, ATTR_COMMENT);
+          i++;
+        }
+        continue;
+      }
+      else if (len - i >= mcs_len && !strncmp(&s[i], mcs, mcs_len))
+      {
+        HL_MARK(mcs_len, ATTR_COMMENT);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+    if (syn->flags & HL_HIGHLIGHT_STRINGS)
+    {
+      if (in_string)
+      {
+        HL_MARK(1, ATTR_STRING);
+        if (c == '\\' && i + 1 < len)
+        {
+          i++;
+          HL_MARK(1, ATTR_STRING);
+        }
+        else if (c == in_string)
+        {
+          in_string = 0;
+        }
+        i++;
+        prev_sep = 1;
+        continue;
+      }
+      else if (c == '"' || c == '\'')
+      {
+        in_string = c;
+        HL_MARK(1, ATTR_STRING);
+        i++;
+        continue;
+      }
+    }
+    if ((syn->flags & HL_HIGHLIGHT_NUMBERS) &&
+        ((isdigit((unsigned char)c) && (prev_sep || prev == ATTR_NUMBER)) || (c == '.' && prev == ATTR_NUMBER)))
+    {
+      HL_MARK(1, ATTR_NUMBER);
+      i++;
+      prev_sep = 0;
+      continue;
+    }
+    if (prev_sep)
+    {
+      int j;
+      for (j = 0; syn->keywords[j]; j++)
+      {
+        int klen = strlen(syn->keywords[j]);
+        int kw2 = syn->keywords[j][klen - 1] == '|'; // a trailing | marks a type keyword
+        if (kw2)
+          klen--;
+        if (len - i >= klen && !strncmp(&s[i], syn->keywords[j], klen) &&
+            (i + klen == len || is_separator((unsigned char)s[i + klen])))
+        {
+          HL_MARK(klen, kw2 ? ATTR_KEYWORD2 : ATTR_KEYWORD1);
+          i += klen;
+          break;
+        }
+      }
+      if (syn->keywords[j] != NULL)
+      {
+        prev_sep = 0;
+        continue;
+      }
+    }
+    HL_MARK(1, ATTR_NORMAL);
+    prev_sep = is_separator((unsigned char)c);
+    i++;
+  }
+#undef HL_MARK
+  return in_comment;
+}
+
+int editorRowLex(editor_row *row, int state) // end state of a row that starts in state
+{
+  if (row->size >= LEXI_LONG_ROW)
+    return state;
+  return editorLex(row->chars, row->size, state, NULL);
+}
+
+int editorRowEndState(long long y) // lexer state at the end of row y, lexing the rows above it as needed
+{
+  if (y < 0 || E.syntax == NULL)
+    return 0;
+  long long from = y;
+  while (from >= 0 && from > y - LEXI_HL_LOOKBACK && editorRowAt(from)->hl_end < 0)
+    from--;
+  int state = 0; // past the lookback the lexer assumes it is outside any comment
+  if (from >= 0 && editorRowAt(from)->hl_end >= 0)
+    state = editorRowAt(from)->hl_end;
+  for (from++; from <= y; from++)
+  {
+    editor_row *row = editorRowAt(from);
+    state = row->hl_end = editorRowLex(row, state);
+  }
+  return state;
+}
+
+void editorHighlightFrom(long long y) // re-lexes from row y down until a row ends in the state it had before
+{
+  if (E.syntax == NULL)
+    return;
+  int state = editorRowEndState(y - 1);
+  long long stop = y + LEXI_HL_PROPAGATE;
+  long long bridge = y; // rows before this lead on to a lexed row
+  for (; y < E.numrows && y < stop; y++)
+  {
+    editor_row *row = editorRowAt(y);
+    if (row->hl_end < 0 && y >= bridge)
+    {
+      // rows never lexed get their state when drawn, from the rows above
+      // them as far as the lookback goes, so the state is only carried on
+      // through them to a lexed row that close
+      for (bridge = y + 1; bridge < E.numrows && bridge < y + LEXI_HL_LOOKBACK; bridge++)
+        if (editorRowAt(bridge)->hl_end >= 0)
+          break;
+      if (bridge == E.numrows || bridge == y + LEXI_HL_LOOKBACK)
+        break;
+    }
+    int end = editorRowLex(row, state);
+    if (end == row->hl_end)
+      break;
+    row->hl_end = end;
+    state = end;
+  }
+}
+
+void editorSelectSyntaxHighlight() // picks the syntax for the file name and forgets every cached state
+{
+  struct editor_syntax *syn = NULL;
+  unsigned int j;
+  if (E.filename)
+  {
+    char *base = strrchr(E.filename, '/') ? strrchr(E.filename, '/') + 1 : E.filename;
+    char *ext = strrchr(base, '.');
+    for (j = 0; j < HLDB_ENTRIES && syn == NULL; j++)
+    {
+      int i;
+      for (i = 0; HLDB[j].filematch[i] && syn == NULL; i++)
+      {
+        const char *m = HLDB[j].filematch[i];
+        if ((m[0] == '.' && ext && !strcmp(ext, m)) || (m[0] != '.' && !strcmp(base, m)))
+          syn = &HLDB[j];
+      }
+    }
+  }
+  if (syn == E.syntax)
+    return;
+  E.syntax = syn;
+  buffer_node *leaf;
+  int idx;
+  for (leaf = bufLeafAt(0, &idx); leaf; leaf = leaf->next)
+    if (leaf->rows)
+      for (idx = 0; idx < leaf->n; idx++)
+        leaf->rows[idx].hl_end = -1;
+  for (j = 0; j < (unsigned int)E.rcache_size; j++) // cached renders may lack colors
+    E.rcache[j].gen++;
+}
+
+/*** row operations ***/
+
+long long editorRowCxToRx(editor_row *row, long long cursor_x)
+{
+  struct col_mark m = {0, 0};
+  if (row->size >= LEXI_COL_STEP)
+    m = editorRowMark(row, cursor_x, 0);
+  return editorColumns(row->chars, m.cx, cursor_x, m.rx);
+} // converts a chars index into a render index
+
+long long editorRowRxToCx(editor_row *row, long long rx)
+{
+  struct col_mark m = {0, 0};
+  if (row->size >= LEXI_COL_STEP)
+    m = editorRowMark(row, rx, 1);
+  long long cur_rx = m.rx;
+  long long cx;
+  for (cx = m.cx; cx < row->size; cx++)
+  {
+    if (row->chars[cx] == '\t')
+      cur_rx += (LEXI_TAB_STOP - 1) - (cur_rx % LEXI_TAB_STOP);
+    cur_rx++;
+    if (cur_rx > rx)
+      return cx;
+  }
+  return cx;
+}
+
+void editorRowReserve(editor_row *row, long long need) // makes room for need bytes of text plus the NUL
+{
+  if (row->cap > need)
+    return;
+  long long cap;
+  char *chars = slabAlloc(need + 1 > row->cap * 2 ? need + 1 : row->cap * 2, &cap);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  if (row->cap)
+    slabFree(row->chars, row->cap);
+  row->chars = chars;
+  row->cap = cap;
+  row->mapped = 0;
+}
+
+void editorRowOwn(editor_row *row) // copies a row out of the mapping or a load arena before it is modified
+{
+  if (row->cap == 0)
+    editorRowReserve(row, row->size);
+}
+
+// Renders are made on demand for the rows being drawn. A row without tabs
+// renders as its own chars; the rest share a small cache of expanded copies
+// that is recycled with a clock sweep, so rows that are off screen cost
+// nothing beyond their text. Rows of LEXI_COL_STEP bytes or more also keep
+// column marks in their slot, so moving the cursor along a line of many
+// megabytes walks at most one step of it.
+
+void editorRowDropRender(editor_row *row) // forgets the cached render of a row
+{
+  if (row->rslot >= 0 && E.rcache[row->rslot].gen == row->rgen)
+  {
+    E.rcache[row->rslot].gen++;
+    E.rcache[row->rslot].used = 0;
+  }
+  row->rslot = -1;
+}
+
+void editorUpdaterow(long long y, long long at) // the text of row y changed from byte at onwards
+{
+  editor_row *row = editorRowAt(y);
+  if (row->rslot >= 0 && E.rcache[row->rslot].gen == row->rgen && E.rcache[row->rslot].nmarks > 1)
+  {
+    struct render_slot *slot = &E.rcache[row->rslot]; // marks before the edit still hold
+    slot->rendered = 0;
+    while (slot->nmarks > 1 && slot->marks[slot->nmarks - 1].cx > at)
+      slot->nmarks--;
+  }
+  else
+  {
+    editorRowDropRender(row);
+  }
+  editorHighlightFrom(y);
+}
+
+struct render_slot *editorRenderSlot() // picks the slot to recycle for a new render
+{
+  while (1)
+  {
+    struct render_slot *slot = &E.rcache[E.rcache_hand];
+    E.rcache_hand = (E.rcache_hand + 1) % E.rcache_size;
+    if (!slot->used)
+      return slot;
+    slot->used = 0;
+  }
+}
+
+struct render_slot *editorRowSlot(editor_row *row, int claim) // the slot of a row, NULL if it has none and claim is 0
+{
+  struct render_slot *slot;
+  if (row->rslot >= 0 && E.rcache[row->rslot].gen == row->rgen)
+  {
+    slot = &E.rcache[row->rslot];
+    slot->used = 1;
+    return slot;
+  }
+  if (!claim)
+    return NULL;
+  slot = editorRenderSlot();
+  slot->gen++;
+  slot->used = 1;
+  slot->rendered = 0;
+  slot->nmarks = 0;
+  row->rslot = slot - E.rcache;
+  row->rgen = slot->gen;
+  return slot;
+}
+
+long long editorColumns(const char *s, long long from, long long to, long long rx) // render column after s[from..to) when s[from] starts at rx
+{
+  long long j;
+  for (j = from; j < to; j++)
+  {
+    if (s[j] == '\t')
+      rx += (LEXI_TAB_STOP - 1) - (rx % LEXI_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+
+struct col_mark editorRowMark(editor_row *row, long long key, int by_rx) // last mark at or before chars index (or render column) key
+{
+  struct render_slot *slot = editorRowSlot(row, 1);
+  if (slot->nmarks == 0)
+  {
+    if (slot->markcap == 0)
+    {
+      slot->markcap = 16;
+      slot->marks = malloc(slot->markcap * sizeof(struct col_mark));
+      if (slot->marks == NULL)
+        die("malloc");
+    }
+    slot->marks[0].cx = slot->marks[0].rx = 0;
+    slot->nmarks = 1;
+  }
+  while (1) // extend the marks up to key, they stay built for later lookups
+  {
+    struct col_mark last = slot->marks[slot->nmarks - 1];
+    if ((by_rx ? last.rx : last.cx) > key || last.cx + LEXI_COL_STEP > row->size)
+      break;
+    if (slot->nmarks == slot->markcap)
+    {
+      slot->markcap *= 2;
+      slot->marks = realloc(slot->marks, slot->markcap * sizeof(struct col_mark));
+      if (slot->marks == NULL)
+        die("realloc");
+    }
+    struct col_mark *next = &slot->marks[slot->nmarks++];
+    next->cx = last.cx + LEXI_COL_STEP;
+    next->rx = editorColumns(row->chars, last.cx, next->cx, last.rx);
+  }
+  long long lo = 0, hi = slot->nmarks - 1;
+  while (lo < hi)
+  {
+    long long mid = (lo + hi + 1) / 2;
+    if ((by_rx ? slot->marks[mid].rx : slot->marks[mid].cx) <= key)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return slot->marks[lo];
+}
+
+char *editorRowRender(editor_row *row, long long *rsize) // tab-expanded text of a row, valid until the next call
+{
+  struct render_slot *slot = editorRowSlot(row, 0);
+  if (slot && slot->rendered)
+  {
+    *rsize = slot->rsize;
+    return slot->render;
+  }
+  long long tabs = 0;
+  long long j;
+  for (j = 0; j < row->size; j++)
+    if (row->chars[j] == '\t')
+      tabs++;
+  if (tabs == 0 && E.syntax == NULL) // highlighted rows need a slot for their colors
+  {
+    *rsize = row->size;
+    return row->chars;
+  }
+  if (slot == NULL)
+    slot = editorRowSlot(row, 1);
+  long long need = row->size + tabs * (LEXI_TAB_STOP - 1);
+  if (slot->cap < need)
+  {
+    free(slot->render);
+    free(slot->hl);
+    slot->render = malloc(need);
+    slot->hl = malloc(need);
+    if (slot->render == NULL || slot->hl == NULL)
+      die("malloc");
+    slot->cap = need;
+  }
+  long long idx = 0;
+  for (j = 0; j < row->size; j++)
+  {
+    if (row->chars[j] == '\t')
+    {
+      slot->render[idx++] = ' ';
+      while (idx % LEXI_TAB_STOP != 0)
+        slot->render[idx++] = ' ';
+    }
+    else
+    {
+      slot->render[idx++] = row->chars[j];
+    }
+  }
+  slot->rsize = idx;
+  slot->hl_start = -1;
+  slot->rendered = 1;
+  *rsize = idx;
+  return slot->render;
+}
+
+char *editorRowWindow(editor_row *row, long long coloff, long long cols, long long *len) // render columns [coloff, coloff + cols) of a long row
+{
+  if (E.window_cap < cols)
+  {
+    E.window = realloc(E.window, cols);
+    if (E.window == NULL)
+      die("realloc");
+    E.window_cap = cols;
+  }
+  struct col_mark m = editorRowMark(row, coloff, 1); // at most a step of text is walked before the window
+  long long cx, rx = m.rx, n = 0;
+  for (cx = m.cx; cx < row->size && rx < coloff + cols; cx++)
+  {
+    char c = row->chars[cx];
+    long long w = c == '\t' ? LEXI_TAB_STOP - rx % LEXI_TAB_STOP : 1;
+    for (; w > 0 && rx < coloff + cols; w--, rx++)
+      if (rx >= coloff)
+        E.window[n++] = c == '\t' ? ' ' : c;
+  }
+  *len = n;
+  return E.window;
+}
+
+unsigned char *editorRowHighlight(long long y, editor_row *row) // colors of the render of row y, NULL if there is no syntax
+{
+  if (E.syntax == NULL)
+    return NULL;
+  long long rsize;
+  editorRowRender(row, &rsize);
+  struct render_slot *slot = &E.rcache[row->rslot];
+  int start = editorRowEndState(y - 1);
+  if (slot->hl_start != start)
+  {
+    row->hl_end = editorLex(slot->render, rsize, start, slot->hl);
+    slot->hl_start = start;
+  }
+  return slot->hl;
+}
+
+void editorInsertRow(long long at, char *s, size_t len)
+{
+  if (at < 0 || at > E.numrows)
+    return;
+  editor_row row;
+  row.size = len;
+  row.mapped = 0;
+  row.chars = slabAlloc(len + 1, &row.cap);
+  memcpy(row.chars, s, len);
+  row.chars[len] = '\0';
+  row.rslot = -1;
+  row.hl_end = -1;
+  journalRecord(J_ROW_INSERT, at, 0, len, s);
+  bufInsertRow(at, &row);
+  E.alloc.ops[ALLOC_EDIT]++;
+  E.numrows++;
+  E.dirty++;
+  editorHighlightFrom(at);
+}
+
+void editorFreerow(editor_row *row) // frees the memory allocated to an erow
+{
+  editorRowDropRender(row);
+  if (row->cap)
+    slabFree(row->chars, row->cap);
+}
+void editorDelRow(long long at) //
+{
+  if (at < 0 || at >= E.numrows)
+    return;
+  journalRecord(J_ROW_DELETE, at, 0, 1, NULL);
+  editorFreerow(editorRowAt(at));
+  bufDeleteRow(at);
+  E.numrows--;
+  E.dirty++;
+  editorHighlightFrom(at);
+}
+
+void editorRowSplice(long long y, long long at, long long len, const char *s, long long slen)
+{
+  // swaps the len bytes of a row at at for slen bytes of s, moving the rest
+  // of the row once however much changes
+  editor_row *row = editorRowAt(y);
+  if (at < 0 || len < 0 || at + len > row->size || (len == 0 && slen <= 0))
+    return;
+  if (len)
+    journalRecord(J_DELETE, y, at, len, NULL);
+  if (slen)
+    journalRecord(J_INSERT, y, at, slen, s);
+  editorRowReserve(row, slen > len ? row->size - len + slen : row->size); // the old text is copied whole
+  bufResizeRow(y, slen - len);
+  memmove(&row->chars[at + slen], &row->chars[at + len], row->size - at - len + 1);
+  if (slen)
+    memcpy(&row->chars[at], s, slen);
+  row->size += slen - len;
+  editorUpdaterow(y, at);
+  E.alloc.ops[ALLOC_EDIT]++;
+  E.dirty++;
+}
+
+void editorRowDelBytes(long long y, long long at, long long len) // removes len bytes of a row starting at at
+{
+  if (len > 0)
+    editorRowSplice(y, at, len, NULL, 0);
+}
+
+void editorRowInsertBytes(long long y, long long at, const char *s, long long len) // puts len bytes into a row at at
+{
+  editor_row *row = editorRowAt(y);
+  if (at < 0 || at > row->size)
+    at = row->size;
+  editorRowSplice(y, at, 0, s, len);
+}
+
+void editorRowInsertChar(long long y, long long at, int c)
+{
+  char ch = c;
+  editorRowInsertBytes(y, at, &ch, 1);
+}
+
+void editorRowAppendString(long long y, char *s, size_t len) // append string to the end of a row
+{
+  editorRowInsertBytes(y, editorRowAt(y)->size, s, len);
+}
+
+void editorRowTruncate(long long y, long long len) // cuts a row down to its first len bytes
+{
+  editorRowDelBytes(y, len, editorRowAt(y)->size - len);
+}
+
+/*** editor operations ***/
+void editorAddLastRow() // makes the line past the last row a real row, a line break after the last one
+{
+  if (E.numrows > 0)
+  {
+    long long y = E.numrows - 1;
+    undoRecord(UNDO_INSERT, y, editorRowAt(y)->size, y + 1, 0, "\n", 1);
+  }
+  editorInsertRow(E.numrows, "", 0);
+}
+
+void editorInsertChar(int c)
+{
+  char ch = c;
+  int add = E.cursor_y == E.numrows;
+  if (add)
+  {
+    undoBegin(); // the row goes with the byte typed into it
+    editorAddLastRow();
+  }
+  undoRecord(UNDO_INSERT, E.cursor_y, E.cursor_x, E.cursor_y, E.cursor_x + 1, &ch, 1);
+  if (add)
+    undoEnd();
+  editorRowInsertChar(E.cursor_y, E.cursor_x, c);
+  E.cursor_x++;
+}
+
+void editorInsertNewline()
+{
+  if (E.cursor_y == E.numrows)
+  {
+    editorAddLastRow();
+  }
+  else if (E.cursor_x == 0)
+  {
+    undoRecord(UNDO_INSERT, E.cursor_y, 0, E.cursor_y + 1, 0, "\n", 1);
+    editorInsertRow(E.cursor_y, "", 0);
+  }
+  else
+  {
+    editor_row *row = editorRowAt(E.cursor_y);
+    undoRecord(UNDO_INSERT, E.cursor_y, E.cursor_x, E.cursor_y + 1, 0, "\n", 1);
+    editorInsertRow(E.cursor_y + 1, &row->chars[E.cursor_x], row->size - E.cursor_x);
+    editorRowTruncate(E.cursor_y, E.cursor_x);
+  }
+  E.cursor_y++;
+  E.cursor_x = 0;
+}
+
+void editorDelChar()
+{
+  if (E.cursor_y == E.numrows)
+    return;
+  if (E.cursor_x == 0 && E.cursor_y == 0)
+    return;
+  editor_row *row = editorRowAt(E.cursor_y);
+  if (E.cursor_x > 0)
+  {
+    undoRecord(UNDO_DELETE, E.cursor_y, E.cursor_x - 1, E.cursor_y, E.cursor_x, &row->chars[E.cursor_x - 1], 1);
+    editorRowDelBytes(E.cursor_y, E.cursor_x - 1, 1);
+    E.cursor_x--;
+  }
+  else
+  {
+    undoRecord(UNDO_DELETE, E.cursor_y - 1, editorRowAt(E.cursor_y - 1)->size, E.cursor_y, 0, "\n", 1);
+    E.cursor_x = editorRowAt(E.cursor_y - 1)->size;
+    editorRowAppendString(E.cursor_y - 1, row->chars, row->size);
+    editorDelRow(E.cursor_y);
+    E.cursor_y--;
+  }
+}
+void editorInsertText(const char *s, size_t len) // inserts a block of text at the cursor, splitting lines at \n in one pass
+{
+  undoBegin();
+  if (E.cursor_y == E.numrows)
+    editorAddLastRow();
+  long long lines = 0;
+  const char *last = s; // start of the last line of s
+  const char *nl;
+  while ((nl = memchr(last, '\n', s + len - last)) != NULL)
+  {
+    lines++;
+    last = nl + 1;
+  }
+  undoRecord(UNDO_INSERT, E.cursor_y, E.cursor_x, E.cursor_y + lines,
+             (lines ? 0 : E.cursor_x) + (s + len - last), s, len);
+  undoEnd();
+  editor_row *row = editorRowAt(E.cursor_y);
+  long long taillen = row->size - E.cursor_x;
+  char *tail = malloc(taillen + 1);
+  if (tail == NULL)
+    die("malloc");
+  memcpy(tail, &row->chars[E.cursor_x], taillen);
+  editorRowTruncate(E.cursor_y, E.cursor_x);
+  long long y = E.cursor_y;
+  const char *p = s;
+  const char *end = s + len;
+  while (1)
+  {
+    const char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    if (p == s)
+      editorRowAppendString(y, (char *)p, eol - p);
+    else
+      editorInsertRow(++y, (char *)p, eol - p);
+    if (eol == end)
+      break;
+    p = eol + 1;
+  }
+  E.cursor_y = y;
+  E.cursor_x = editorRowAt(y)->size;
+  editorRowAppendString(y, tail, taillen);
+  free(tail);
+}
+
+void editorDeleteText(long long y, long long x, long long ey, long long ex) // removes the text from (y, x) up to (ey, ex)
+{
+  if (ey == y)
+  {
+    editorRowDelBytes(y, x, ex - x);
+    return;
+  }
+  editor_row *last = editorRowAt(ey);
+  editorRowTruncate(y, x);
+  editorRowAppendString(y, &last->chars[ex], last->size - ex);
+  while (ey-- > y)
+    editorDelRow(y + 1);
+}
+
+void editorPaste(int discard) // reads a bracketed paste in large chunks and inserts it as one block, or drops it
+{
+  static const char endmark[] = "\x1b[201~";
+  size_t cap = LEXI_PASTE_CHUNK;
+  size_t len = E.inputlen - E.inputpos;
+  if (cap < len + LEXI_PASTE_CHUNK)
+    cap = len + LEXI_PASTE_CHUNK;
+  char *text = malloc(cap);
+  if (text == NULL)
+    die("malloc");
+  if (len)
+    memcpy(text, E.input + E.inputpos, len);
+  char *mark = memmem(text, len, endmark, 6);
+  int waits = 0;
+#ifdef LEXI_BENCH
+  waits = LEXI_PASTE_WAIT; // the script is all the input there is
+#endif
+  while (mark == NULL && waits < LEXI_PASTE_WAIT)
+  {
+    if (cap - len < LEXI_PASTE_CHUNK)
+    {
+      cap *= 2;
+      text = realloc(text, cap);
+      if (text == NULL)
+        die("realloc");
+    }
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0)
+    {
+      waits++;
+      continue;
+    }
+    if (!(pfd.revents & POLLIN)) // hung up with nothing left to read
+      break;
+    ssize_t nread = read(STDIN_FILENO, text + len, LEXI_PASTE_CHUNK);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
+      die("read");
+    if (nread == 0) // the input ended before the paste did
+      break;
+    if (nread < 0)
+      continue;
+    waits = 0;
+    size_t from = len > 5 ? len - 5 : 0; // the end mark may straddle two reads
+    len += nread;
+    mark = memmem(text + from, len - from, endmark, 6);
+  }
+  size_t textlen = mark ? (size_t)(mark - text) : len;
+  size_t j, n = 0;
+  for (j = 0; j < textlen && !discard; j++) // terminals send line breaks as \r
+  {
+    if (text[j] == '\r' && j + 1 < textlen && text[j + 1] == '\n')
+      continue;
+    text[n++] = text[j] == '\r' ? '\n' : text[j];
+  }
+  if (!discard)
+    editorInsertText(text, n);
+  free(E.input); // whatever followed the paste is read before the terminal
+  E.input = text;
+  E.inputpos = mark ? textlen + 6 : len;
+  E.inputlen = len;
+}
+
+/*** undo ***/
+
+// Edits are logged as the text they put in or took out and where, so undoing
+// one costs what the edit did and the buffer is never snapshotted. Typing or
+// deleting a byte at a time grows the newest entry instead of adding one per
+// key, and a paste is a single entry however many lines it has. The text
+// goes into blocks that are only ever appended to; when the log outgrows its
+// limit the oldest blocks are freed together with the entries using them.
+
+char *undoText(long long len, long long spare) // takes len bytes at the end of the newest block, which gets spare more free
+{
+  struct undo_block *b = E.undo.last;
+  if (b == NULL || b->size - b->used < len + spare)
+  {
+    long long size = len + spare > LEXI_UNDO_BLOCK ? len + spare : LEXI_UNDO_BLOCK;
+    b = malloc(sizeof(struct undo_block) + size);
+    if (b == NULL)
+      die("malloc");
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    if (E.undo.last)
+      E.undo.last->next = b;
+    else
+      E.undo.first = b;
+    E.undo.last = b;
+    E.undo.bytes += size;
+  }
+  b->used += len;
+  return b->data + b->used - len;
+}
+
+void undoTrim() // frees the oldest blocks and their entries until the log fits its limit
+{
+  while (E.undo.first && E.undo.bytes + E.undo.n * (long long)sizeof(struct undo_entry) > E.undo.limit)
+  {
+    struct undo_block *b = E.undo.first;
+    long long k = 0;
+    while (k < E.undo.n && E.undo.entries[k].block == b)
+      k++;
+    while (k > 0 && k < E.undo.n && E.undo.entries[k].group == E.undo.entries[k - 1].group)
+      k++; // a group goes as a whole
+    memmove(E.undo.entries, E.undo.entries + k, (E.undo.n - k) * sizeof(struct undo_entry));
+    E.undo.n -= k;
+    E.undo.done = E.undo.done > k ? E.undo.done - k : 0;
+    E.undo.first = b->next;
+    if (E.undo.first == NULL)
+      E.undo.last = NULL;
+    E.undo.bytes -= b->size;
+    free(b);
+  }
+}
+
+void undoClear() // forgets every edit, for when the buffer is replaced
+{
+  while (E.undo.first)
+  {
+    struct undo_block *b = E.undo.first;
+    E.undo.first = b->next;
+    free(b);
+  }
+  E.undo.last = NULL;
+  E.undo.bytes = 0;
+  E.undo.n = E.undo.done = 0;
+  E.undo.open = 0;
+}
+
+void undoBegin() // edits until the matching undoEnd are undone as one
+{
+  if (E.undo.nest++ == 0)
+    E.undo.group++;
+}
+
+void undoEnd()
+{
+  E.undo.nest--;
+}
+
+void undoGrow(struct undo_entry *e, char c) // adds a byte to the end of the text of the newest entry, which may then be trimmed
+{
+  struct undo_block *b = E.undo.last;
+  if (e->text + e->len == b->data + b->used && b->used < b->size)
+  {
+    b->used++;
+  }
+  else
+  {
+    char *text = undoText(e->len + 1, e->len); // moved to the newest block with room to double
+    memcpy(text, e->text, e->len);
+    e->text = text;
+    e->block = E.undo.last;
+  }
+  e->text[e->len++] = c;
+  undoTrim(); // moving the text may have taken a new block
+}
+
+void undoRecord(int kind, long long y, long long x, long long ey, long long ex, const char *text, long long len)
+{
+  if (E.undo.replaying || len == 0)
+    return;
+  E.undo.n = E.undo.done; // a new edit drops what could be redone
+  int single = len == 1 && text[0] != '\n';
+  struct undo_entry *e = E.undo.done ? &E.undo.entries[E.undo.done - 1] : NULL;
+  if (single && e && E.undo.open && (!E.undo.nest || e->group == E.undo.group) &&
+      e->kind == kind && e->y == y && e->ey == y)
+  {
+    if (kind == UNDO_INSERT && e->ex == x) // typing on
+    {
+      e->ex = ex;
+      undoGrow(e, text[0]);
+      return;
+    }
+    if (kind == UNDO_DELETE && e->x == ex && (e->back || e->len == 1)) // backspacing on
+    {
+      e->x = x;
+      e->back = 1;
+      undoGrow(e, text[0]);
+      return;
+    }
+    if (kind == UNDO_DELETE && e->x == x && (!e->back || e->len == 1)) // deleting forward
+    {
+      e->ex++;
+      e->back = 0;
+      undoGrow(e, text[0]);
+      return;
+    }
+  }
+  if (E.undo.n == E.undo.cap)
+  {
+    E.undo.cap = E.undo.cap ? E.undo.cap * 2 : 64;
+    E.undo.entries = realloc(E.undo.entries, E.undo.cap * sizeof(struct undo_entry));
+    if (E.undo.entries == NULL)
+      die("realloc");
+  }
+  e = &E.undo.entries[E.undo.n++];
+  E.undo.done = E.undo.n;
+  e->kind = kind;
+  e->back = kind == UNDO_DELETE && len == 1;
+  e->group = E.undo.nest ? E.undo.group : ++E.undo.group;
+  e->y = y;
+  e->x = x;
+  e->ey = ey;
+  e->ex = ex;
+  e->text = undoText(len, 0);
+  memcpy(e->text, text, len);
+  e->len = len;
+  e->block = E.undo.last;
+  E.undo.open = single;
+  undoTrim();
+}
+
+void undoApply(struct undo_entry *e, int undo) // reverts an entry, or makes it again
+{
+  if (e->kind == UNDO_REPLACE)
+  {
+    long long now = e->ex - e->x, was = e->len - now;
+    if (undo)
+      editorRowSplice(e->y, e->x, now, e->text, was);
+    else
+      editorRowSplice(e->y, e->x, was, e->text + was, now);
+    E.cursor_y = e->y;
+    E.cursor_x = e->x;
+    return;
+  }
+  if ((e->kind == UNDO_INSERT) == undo)
+  {
+    editorDeleteText(e->y, e->x, e->ey, e->ex);
+    E.cursor_y = e->y;
+    E.cursor_x = e->x;
+    return;
+  }
+  char *text = e->text;
+  if (e->back && e->len > 1)
+  {
+    text = malloc(e->len);
+    if (text == NULL)
+      die("malloc");
+    long long j;
+    for (j = 0; j < e->len; j++)
+      text[j] = e->text[e->len - 1 - j];
+  }
+  E.cursor_y = e->y;
+  E.cursor_x = e->x;
+  editorInsertText(text, e->len);
+  if (text != e->text)
+    free(text);
+  if (undo && !e->back) // undoing a forward delete leaves the cursor where it was
+  {
+    E.cursor_y = e->y;
+    E.cursor_x = e->x;
+  }
+}
+
+void editorUndo()
+{
+  if (E.undo.done == 0)
+  {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  unsigned long long group = E.undo.entries[E.undo.done - 1].group;
+  E.undo.replaying = 1;
+  while (E.undo.done > 0 && E.undo.entries[E.undo.done - 1].group == group)
+    undoApply(&E.undo.entries[--E.undo.done], 1);
+  E.undo.replaying = 0;
+  E.undo.open = 0;
+}
+
+void editorRedo()
+{
+  if (E.undo.done == E.undo.n)
+  {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  unsigned long long group = E.undo.entries[E.undo.done].group;
+  E.undo.replaying = 1;
+  while (E.undo.done < E.undo.n && E.undo.entries[E.undo.done].group == group)
+    undoApply(&E.undo.entries[E.undo.done++], 0);
+  E.undo.replaying = 0;
+  E.undo.open = 0;
+}
+
+/*** loader ***/
+
+// Files are split into rows by a loader thread, so the first screen shows up
+// at once however big the file is. A mapped file is cut into leaves that only
+// record where their lines start; anything else is read into arena blocks
+// and each line becomes a row viewing its block. The loader builds whole
+// leaves on its own and hands them over in batches; only the main thread
+// hangs them off the tree, after whatever rows are there, so edits made
+// meanwhile never race with it.
+
+void loadQueue(struct load_state *ld, buffer_node *leaf) // loader side: adds a leaf to the batch being built
+{
+  if (ld->blast)
+    ld->blast->next = leaf;
+  else
+    ld->bfirst = leaf;
+  ld->blast = leaf;
+}
+
+void loadMapped(struct load_state *ld, size_t budget)
+{
+  // cuts the next `budget` bytes of the mapping into leaves that only record
+  // where their lines start; rows are made when a leaf is first visited
+  size_t stop = ld->pos + budget;
+  char *end = E.map + E.maplen;
+  while (ld->pos < E.maplen && ld->pos < stop)
+  {
+    buffer_node *leaf = calloc(1, sizeof(buffer_node));
+    if (leaf == NULL)
+      die("calloc");
+    leaf->leaf = 1;
+    leaf->mapoff = ld->pos;
+    char *p = E.map + ld->pos;
+    while (leaf->n < LEXI_LEAF_ROWS / 2 && p < end) // leave room for lines typed later
+    {
+      char *nl = memchr(p, '\n', end - p);
+      char *eol = nl ? nl : end;
+      while (eol > p && eol[-1] == '\r') // rows drop the \r, so the saved file will too
+        eol--;
+      leaf->nbytes += eol - p + 1;
+      p = nl ? nl + 1 : end;
+      leaf->n++;
+    }
+    leaf->nrows = leaf->n;
+    leaf->mapend = p - E.map;
+    ld->bbytes += leaf->mapend - leaf->mapoff;
+    ld->pos = leaf->mapend;
+    loadQueue(ld, leaf);
+  }
+}
+
+void loadRow(struct load_state *ld, char *s, char *eol) // loader side: makes a row of s up to eol, dropping its \r
+{
+  while (eol > s && eol[-1] == '\r')
+    eol--;
+  *eol = '\0';
+  buffer_node *leaf = ld->blast;
+  if (leaf == NULL || leaf->n == LEXI_LEAF_ROWS / 2) // leave room for lines typed later
+  {
+    leaf = bufNewNode(1);
+    ld->ballocs += 2;
+    loadQueue(ld, leaf);
+  }
+  editor_row *row = &leaf->rows[leaf->n++];
+  row->size = eol - s;
+  row->cap = 0;
+  row->mapped = 0;
+  row->hl_end = -1;
+  row->chars = s;
+  row->rslot = -1;
+  leaf->nrows++;
+  leaf->nbytes += row->size + 1;
+}
+
+int loadFill(struct load_state *ld) // loader side: reads more of the file, 0 at its end
+{
+  if (ld->block == NULL || ld->filled + 1 >= ld->size) // the unfinished line moves to a new block
+  {
+    size_t tail = ld->filled - ld->used;
+    size_t size = sizeof(char *) + (tail * 2 + 2 > LEXI_ARENA_SIZE ? tail * 2 + 2 : LEXI_ARENA_SIZE);
+    char *block = malloc(size);
+    if (block == NULL)
+      die("malloc");
+    ld->ballocs++;
+    memcpy(block, &ld->barenas, sizeof(char *));
+    ld->barenas = block;
+    if (tail)
+      memcpy(block + sizeof(char *), ld->block + ld->used, tail);
+    ld->block = block;
+    ld->size = size;
+    ld->used = sizeof(char *);
+    ld->filled = ld->used + tail;
+  }
+  ssize_t n;
+  do
+    n = read(ld->fd, ld->block + ld->filled, ld->size - ld->filled - 1); // one byte is kept for the last NUL
+  while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return 0;
+  ld->filled += n;
+  return 1;
+}
+
+int loadRead(struct load_state *ld, size_t budget) // loader side: turns about `budget` bytes into rows, 0 at the end
+{
+  size_t done = 0;
+  while (done < budget)
+  {
+    char *p = ld->block ? ld->block + ld->used : NULL;
+    char *nl = p ? memchr(p, '\n', ld->filled - ld->used) : NULL;
+    if (nl == NULL)
+    {
+      if (done > 0) // hand over what is there before the read, it may block on a pipe
+        break;
+      if (loadFill(ld))
+        continue;
+      if (ld->block && ld->used < ld->filled) // the last line has no newline
+      {
+        p = ld->block + ld->used;
+        loadRow(ld, p, ld->block + ld->filled);
+        ld->partial = p;
+        done += ld->filled - ld->used;
+        ld->used = ld->filled;
+      }
+      ld->bbytes += done;
+      return 0;
+    }
+    loadRow(ld, p, nl);
+    done += nl + 1 - p;
+    ld->off += nl + 1 - p;
+    ld->used = nl + 1 - ld->block;
+  }
+  ld->bbytes += done;
+  return 1;
+}
+
+void *loadThread(void *arg)
+{
+  struct load_state *ld = &E.load;
+  size_t budget = LEXI_LOAD_FIRST; // a first screenful comes out right away
+  int more = 1;
+  (void)arg;
+  while (more && !__atomic_load_n(&ld->cancel, __ATOMIC_RELAXED))
+  {
+    if (ld->fd == -1)
+    {
+      loadMapped(ld, budget);
+      more = ld->pos < E.maplen;
+    }
+    else
+    {
+      more = loadRead(ld, budget);
+    }
+    budget = LEXI_INDEX_CHUNK;
+    pthread_mutex_lock(&ld->lock);
+    if (ld->bfirst)
+    {
+      if (ld->last)
+        ld->last->next = ld->bfirst;
+      else
+        ld->first = ld->bfirst;
+      ld->last = ld->blast;
+    }
+    while (ld->barenas) // blocks go over one by one, there are only a few per batch
+    {
+      char *block = ld->barenas;
+      memcpy(&ld->barenas, block, sizeof(char *));
+      memcpy(block, &ld->arenas, sizeof(char *));
+      ld->arenas = block;
+    }
+    ld->bytes += ld->bbytes;
+    ld->allocs += ld->ballocs;
+    ld->done = !more;
+    pthread_cond_broadcast(&ld->cond);
+    pthread_mutex_unlock(&ld->lock);
+    if (write(ld->wake[1], "", 1) == -1 && errno != EAGAIN)
+      die("write");
+    ld->bfirst = ld->blast = NULL;
+    ld->bbytes = ld->ballocs = 0;
+  }
+  pthread_mutex_lock(&ld->lock);
+  ld->done = 1;
+  pthread_cond_broadcast(&ld->cond);
+  pthread_mutex_unlock(&ld->lock);
+  return NULL;
+}
+
+void loadStart(int fd, long long total) // starts loading the mapping, or fd when it is not -1
+{
+  struct load_state *ld = &E.load;
+  struct stat st;
+  ld->fd = fd;
+  ld->stream = fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode));
+  ld->total = total;
+  ld->loaded = 0;
+  ld->first = ld->last = ld->bfirst = ld->blast = NULL;
+  ld->arenas = ld->barenas = NULL;
+  ld->bytes = ld->bbytes = ld->allocs = ld->ballocs = 0;
+  ld->done = ld->cancel = 0;
+  ld->pos = 0;
+  ld->block = NULL;
+  ld->used = ld->filled = ld->size = 0;
+  ld->off = 0;
+  ld->partial = NULL;
+  ld->active = 1;
+  if (pthread_create(&ld->thread, NULL, loadThread, NULL) != 0)
+    die("pthread_create");
+}
+
+void loadFinish() // the loader is done: reaps it
+{
+  struct load_state *ld = &E.load;
+  pthread_join(ld->thread, NULL);
+  if (ld->fd != -1)
+  {
+    close(ld->fd);
+    E.follow.off = ld->off;
+    E.follow.partial = ld->partial;
+  }
+  ld->active = 0;
+  char drain[64];
+  while (read(ld->wake[0], drain, sizeof(drain)) > 0)
+    ;
+}
+
+int editorIndexPublish(int wait)
+{
+  // adds the leaves the loader has finished after the last row, waiting for
+  // the next batch first if `wait` is set, or for LEXI_STREAM_WAIT at most
+  // when reading a pipe; returns 0 if nothing came
+  struct load_state *ld = &E.load;
+  if (!ld->active)
+    return 0;
+  char drain[64];
+  while (read(ld->wake[0], drain, sizeof(drain)) > 0)
+    ;
+  pthread_mutex_lock(&ld->lock);
+  if (wait && ld->stream)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += LEXI_STREAM_WAIT * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    while (ld->first == NULL && !ld->done && pthread_cond_timedwait(&ld->cond, &ld->lock, &ts) == 0)
+      ;
+  }
+  while (wait && !ld->stream && ld->first == NULL && !ld->done)
+    pthread_cond_wait(&ld->cond, &ld->lock);
+  buffer_node *leaf = ld->first;
+  char *arenas = ld->arenas;
+  long long bytes = ld->bytes, allocs = ld->allocs;
+  int done = ld->done;
+  int got = leaf != NULL || done;
+  ld->first = ld->last = NULL;
+  ld->arenas = NULL;
+  ld->bytes = ld->allocs = 0;
+  pthread_mutex_unlock(&ld->lock);
+  while (leaf)
+  {
+    buffer_node *next = leaf->next;
+    leaf->next = NULL;
+    bufAppendLeaf(leaf);
+    E.numrows += leaf->n;
+    E.alloc.ops[ALLOC_LOAD] += leaf->n;
+    if (ld->fd == -1)
+      E.mapindexed = leaf->mapend;
+    leaf = next;
+  }
+  while (arenas)
+  {
+    char *block = arenas;
+    memcpy(&arenas, block, sizeof(char *));
+    memcpy(block, &E.store.arenas, sizeof(char *));
+    E.store.arenas = block;
+  }
+  E.alloc.calls[ALLOC_LOAD] += allocs;
+  ld->loaded += bytes;
+  E.redraw = 1;
+  if (done)
+  {
+    loadFinish();
+    struct search_state *st = &E.search;
+    if (st->nchunks && st->partial) // a search over part of the file runs again over all of it
+    {
+      char *query = strdup(st->query);
+      if (st->shown)
+        searchStart(query, E.cursor_y, E.cursor_x);
+      else
+        searchStart(query, st->origin_row, st->origin_col);
+      free(query);
+    }
+  }
+  return got;
+}
+
+void loadCancel() // stops the loader and drops what it had not handed over yet
+{
+  struct load_state *ld = &E.load;
+  if (!ld->active)
+    return;
+  __atomic_store_n(&ld->cancel, 1, __ATOMIC_RELAXED);
+  pthread_join(ld->thread, NULL);
+  while (ld->first)
+  {
+    buffer_node *next = ld->first->next;
+    bufFreeTree(ld->first);
+    ld->first = next;
+  }
+  while (ld->arenas)
+  {
+    char *block = ld->arenas;
+    memcpy(&ld->arenas, block, sizeof(char *));
+    free(block);
+  }
+  if (ld->fd != -1)
+    close(ld->fd);
+  ld->active = 0;
+}
+
+int editorIndexing() // true while the loader has rows left to hand over
+{
+  return E.load.active;
+}
+
+int editorIndexWait() // waits for the loader's next batch of rows, 0 if a pipe had none for now
+{
+  return editorIndexPublish(1);
+}
+
+void editorIndexAll()
+{
+  while (editorIndexing())
+    editorIndexPublish(1);
+}
+
+/*** journal ***/
+
+// Every change to the rows is appended to a journal next to the file
+// (.name.lexi-swp) as a compact binary record, so a lexi that dies keeps its
+// unsaved edits. The editing thread only encodes records into a batch, with
+// runs of typing and deleting growing the newest record in place; a writer
+// thread takes the batch every LEXI_JOURNAL_MS, appends it and syncs it, and
+// once the journal has grown enough it rewrites it with records folded into
+// each other. Opening the file again replays the journal over it, which
+// costs as much as the edits did rather than as much as the file. A save or a
+// deliberate quit removes the journal.
+
+char *journalPath(const char *filename) // .name.lexi-swp in the directory of the file
+{
+  const char *slash = strrchr(filename, '/');
+  const char *name = slash ? slash + 1 : filename;
+  int dirlen = slash ? slash - filename + 1 : 0;
+  size_t len = dirlen + strlen(name) + 11;
+  char *path = malloc(len);
+  if (path == NULL)
+    die("malloc");
+  snprintf(path, len, "%.*s.%s.lexi-swp", dirlen, filename, name);
+  return path;
+}
+
+long long journalStartTime(long long pid) // when pid started in clock ticks after boot, 0 if that cannot be read
+{
+  char path[64], buf[512];
+  snprintf(path, sizeof(path), "/proc/%lld/stat", pid);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  char *p = strrchr(buf, ')'); // the command name may hold spaces and parentheses
+  int field;
+  for (field = 2; field < 22 && p; field++) // starttime is field 22, the name field 2
+    p = strchr(p + 1, ' ');
+  return p ? strtoll(p + 1, NULL, 10) : 0;
+}
+
+void journalBase() // remembers which version of the file the records will apply to
+{
+  struct stat st;
+  memset(&E.journal.base, 0, sizeof(E.journal.base));
+  memcpy(E.journal.base.magic, "LEXIJNL2", 8);
+  E.journal.base.pid_start = journalStartTime(getpid());
+  int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+  if (fd != -1)
+  {
+    if (read(fd, E.journal.base.boot, sizeof(E.journal.base.boot) - 1) < 0)
+      E.journal.base.boot[0] = '\0';
+    close(fd);
+  }
+  if (E.filename && stat(E.filename, &st) == 0)
+  {
+    E.journal.base.size = st.st_size;
+    E.journal.base.mtime = st.st_mtim.tv_sec;
+    E.journal.base.mtime_ns = st.st_mtim.tv_nsec;
+    E.journal.base.ino = st.st_ino;
+  }
+}
+
+void journalPut(struct journal_buf *jb, const char *s, long long len)
+{
+  if (len == 0)
+    return;
+  if (jb->len + len > jb->cap)
+  {
+    long long cap = jb->cap ? jb->cap * 2 : 4096;
+    while (cap < jb->len + len)
+      cap *= 2;
+    jb->b = realloc(jb->b, cap);
+    if (jb->b == NULL)
+      die("realloc");
+    jb->cap = cap;
+  }
+  memcpy(jb->b + jb->len, s, len);
+  jb->len += len;
+}
+
+void journalPutNum(struct journal_buf *jb, unsigned long long v) // seven bits a byte, low bits first
+{
+  char buf[10];
+  int n = 0;
+  while (v >= 0x80)
+  {
+    buf[n++] = (char)(v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[n++] = (char)v;
+  journalPut(jb, buf, n);
+}
+
+const char *journalGetNum(const char *p, const char *end, long long *v)
+{
+  unsigned long long x = 0;
+  int shift;
+  for (shift = 0; p < end && shift < 64; shift += 7)
+  {
+    unsigned char c = *p++;
+    x |= (unsigned long long)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+    {
+      *v = x;
+      return *v < 0 ? NULL : p;
+    }
+  }
+  return NULL;
+}
+
+void journalEncode(struct journal_buf *jb, struct journal_rec *r)
+{
+  char op = r->op;
+  journalPut(jb, &op, 1);
+  journalPutNum(jb, r->y);
+  journalPutNum(jb, r->a);
+  journalPutNum(jb, r->n);
+  if (r->op == J_INSERT || r->op == J_ROW_INSERT)
+    journalPut(jb, r->text, r->n);
+}
+
+const char *journalDecode(const char *p, const char *end, struct journal_rec *r) // NULL at the end or at a torn record
+{
+  if (p >= end)
+    return NULL;
+  r->op = (unsigned char)*p++;
+  if (r->op < J_INSERT || r->op > J_ROW_DELETE)
+    return NULL;
+  if ((p = journalGetNum(p, end, &r->y)) == NULL || (p = journalGetNum(p, end, &r->a)) == NULL ||
+      (p = journalGetNum(p, end, &r->n)) == NULL)
+    return NULL;
+  r->text = NULL;
+  if (r->op == J_INSERT || r->op == J_ROW_INSERT)
+  {
+    if (end - p < r->n)
+      return NULL;
+    r->text = (char *)p;
+    p += r->n;
+  }
+  return p;
+}
+
+void journalSeal(struct journal_state *j) // moves the newest record into the batch, called with the lock held
+{
+  if (j->last.op)
+    journalEncode(&j->batch, &j->last);
+  j->last.op = 0;
+}
+
+int journalEdit(int op)
+{
+  return op == J_INSERT || op == J_DELETE;
+}
+
+int journalSplice(struct journal_rec *t, struct journal_rec *r) // merges edit r into the earlier record t of the same row, 0 if it cannot
+{
+  long long base = t->op == J_ROW_INSERT ? 0 : t->a; // where the text of t starts in the row
+  if (r->op == J_INSERT && t->op != J_DELETE && r->a >= base && r->a <= base + t->n)
+  {
+    t->text = realloc(t->text, t->n + r->n);
+    if (t->text == NULL)
+      die("realloc");
+    memmove(t->text + r->a - base + r->n, t->text + r->a - base, t->n - (r->a - base));
+    memcpy(t->text + r->a - base, r->text, r->n);
+    t->n += r->n;
+    return 1;
+  }
+  if (r->op == J_DELETE && t->op != J_DELETE && r->a >= base && r->a + r->n <= base + t->n)
+  {
+    memmove(t->text + r->a - base, t->text + r->a - base + r->n, t->n - (r->a - base) - r->n);
+    t->n -= r->n;
+    return 1;
+  }
+  if (r->op == J_DELETE && t->op == J_DELETE && (r->a == t->a || r->a + r->n == t->a))
+  {
+    t->a = r->a;
+    t->n += r->n;
+    return 1;
+  }
+  return 0;
+}
+
+void journalDrop(struct journal_rec *recs, long long *n, long long k)
+{
+  free(recs[k].text);
+  memmove(&recs[k], &recs[k + 1], (*n - k - 1) * sizeof(struct journal_rec));
+  (*n)--;
+}
+
+void journalFold(struct journal_rec *recs, long long *n, struct journal_rec *r) // appends r, folding it into earlier records where the result is the same
+{
+  long long k = *n - 1, stop = *n - LEXI_JOURNAL_FOLD; // an edit of every row, as a replace makes, must not cost n^2
+  if (journalEdit(r->op))
+  {
+    while (k >= 0 && k >= stop && journalEdit(recs[k].op) && recs[k].y != r->y) // edits of other rows do not move this one
+      k--;
+    if (k >= 0 && recs[k].y == r->y && recs[k].op != J_ROW_DELETE && journalSplice(&recs[k], r))
+    {
+      if (recs[k].op == J_INSERT && recs[k].n == 0)
+        journalDrop(recs, n, k);
+      free(r->text);
+      return;
+    }
+  }
+  else if (r->op == J_ROW_DELETE)
+  {
+    while (k >= 0 && k >= stop && r->n > 0)
+    {
+      struct journal_rec *t = &recs[k];
+      if (journalEdit(t->op) && t->y < r->y)
+        k--;
+      else if (journalEdit(t->op) && t->y < r->y + r->n) // edits of rows that go anyway
+        journalDrop(recs, n, k--);
+      else if (t->op == J_ROW_INSERT && t->y >= r->y && t->y < r->y + r->n) // a row that came and went
+      {
+        journalDrop(recs, n, k--);
+        r->n--;
+      }
+      else if (t->op == J_ROW_DELETE && t->y == r->y)
+      {
+        t->n += r->n;
+        return;
+      }
+      else
+        break;
+    }
+    if (r->n == 0)
+      return;
+  }
+  recs[(*n)++] = *r;
+}
+
+int journalWrite(int fd, const char *b, long long len) // writes all of b, -1 on an error
+{
+  while (len > 0)
+  {
+    ssize_t w = write(fd, b, len);
+    if (w == -1 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return -1;
+    b += w;
+    len -= w;
+  }
+  return 0;
+}
+
+void journalCompact(struct journal_state *j) // rewrites the journal with its records folded, on the writer thread
+{
+  long long size = j->written;
+  char *buf = malloc(size);
+  if (buf == NULL || pread(j->fd, buf, size, 0) != size)
+  {
+    free(buf);
+    return;
+  }
+  long long n = 0, cap = 1024;
+  struct journal_rec *recs = malloc(cap * sizeof(struct journal_rec));
+  if (recs == NULL)
+    die("malloc");
+  struct journal_rec r;
+  const char *p = buf + sizeof(struct journal_header);
+  while ((p = journalDecode(p, buf + size, &r)) != NULL)
+  {
+    if (n == cap)
+    {
+      recs = realloc(recs, (cap *= 2) * sizeof(struct journal_rec));
+      if (recs == NULL)
+        die("realloc");
+    }
+    if (r.text)
+    {
+      char *text = malloc(r.n ? r.n : 1);
+      if (text == NULL)
+        die("malloc");
+      memcpy(text, r.text, r.n);
+      r.text = text;
+    }
+    journalFold(recs, &n, &r);
+  }
+  struct journal_buf out = {NULL, 0, 0};
+  journalPut(&out, buf, sizeof(struct journal_header));
+  long long k;
+  for (k = 0; k < n; k++)
+  {
+    journalEncode(&out, &recs[k]);
+    free(recs[k].text);
+  }
+  free(recs);
+  free(buf);
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.new", j->path);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd != -1 && journalWrite(fd, out.b, out.len) == 0 && fdatasync(fd) != -1 && rename(tmp, j->path) != -1)
+  {
+    close(j->fd);
+    j->fd = fd;
+    j->written = j->compacted = out.len;
+  }
+  else if (fd != -1)
+  {
+    close(fd);
+    unlink(tmp);
+  }
+  free(out.b);
+}
+
+void *journalWriter(void *arg) // appends the batched records until told to stop
+{
+  (void)arg;
+  struct journal_state *j = &E.journal;
+  struct journal_buf spare = {NULL, 0, 0};
+  pthread_mutex_lock(&j->lock);
+  while (1)
+  {
+    if (!j->stop)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += LEXI_JOURNAL_MS * 1000000L;
+      ts.tv_sec += ts.tv_nsec / 1000000000L;
+      ts.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&j->cond, &j->lock, &ts);
+    }
+    journalSeal(j);
+    struct journal_buf batch = j->batch;
+    j->batch = spare;
+    int stop = j->stop;
+    pthread_mutex_unlock(&j->lock);
+    if (batch.len && !j->error)
+    {
+      if (journalWrite(j->fd, batch.b, batch.len) == 0 && fdatasync(j->fd) == 0)
+      {
+        j->written += batch.len;
+      }
+      else
+      {
+        pthread_mutex_lock(&j->lock); // the main thread stops journaling at the next edit
+        j->error = errno;
+        pthread_mutex_unlock(&j->lock);
+      }
+    }
+    batch.len = 0;
+    spare = batch;
+    if (!j->error && j->written > 2 * j->compacted + LEXI_JOURNAL_COMPACT)
+      journalCompact(j);
+    if (stop)
+      break;
+    pthread_mutex_lock(&j->lock);
+  }
+  free(spare.b);
+  return NULL;
+}
+
+void journalRun(int fd, long long size) // starts the writer on an open journal of size bytes
+{
+  struct journal_state *j = &E.journal;
+  j->fd = fd;
+  j->written = j->compacted = size;
+  j->stop = 0;
+  j->error = 0;
+  j->batch.len = 0;
+  j->last.op = 0;
+  if (pthread_create(&j->thread, NULL, journalWriter, NULL) != 0)
+    die("pthread_create");
+  j->on = 1;
+}
+
+int journalStart() // creates the journal for the first edit since the file was opened or saved
+{
+  struct journal_state *j = &E.journal;
+  if (j->failed || E.filename == NULL)
+    return -1;
+  free(j->path);
+  j->path = journalPath(E.filename);
+  int fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  j->base.pid = getpid();
+  if (fd == -1 || write(fd, &j->base, sizeof(j->base)) != sizeof(j->base))
+  {
+    if (fd != -1)
+      close(fd);
+    j->failed = 1;
+    editorSetStatusMessage("Edits are not journaled: %s", strerror(errno));
+    return -1;
+  }
+  journalRun(fd, sizeof(j->base));
+  return 0;
+}
+
+void journalRecord(int op, long long y, long long a, long long n, const char *text)
+{
+  struct journal_state *j = &E.journal;
+  if (j->replaying || (n == 0 && op != J_ROW_INSERT))
+    return;
+  if (!j->on && journalStart() == -1)
+    return;
+  pthread_mutex_lock(&j->lock);
+  if (j->error) // a journal missing edits would recover the wrong text
+  {
+    int err = j->error;
+    pthread_mutex_unlock(&j->lock);
+    journalClose(1);
+    j->failed = 1;
+    editorSetStatusMessage("Edits are no longer journaled: %s", strerror(err));
+    return;
+  }
+  struct journal_rec *l = &j->last;
+  int grow = l->op == op && l->y == y &&
+             ((op == J_INSERT && l->a + l->n == a) ||                // typing on
+              (op == J_DELETE && (l->a == a || a + n == l->a)) ||    // deleting forward or back
+              op == J_ROW_DELETE);
+  if (!grow)
+  {
+    journalSeal(j);
+    l->op = op;
+    l->y = y;
+    l->n = 0;
+  }
+  if (op != J_INSERT || !grow)
+    l->a = a;
+  if (text && n)
+  {
+    if (l->n + n > j->lastcap)
+    {
+      j->lastcap = l->n + n > 2 * j->lastcap ? l->n + n : 2 * j->lastcap;
+      l->text = realloc(l->text, j->lastcap);
+      if (l->text == NULL)
+        die("realloc");
+    }
+    memcpy(l->text + l->n, text, n);
+  }
+  l->n += n;
+  pthread_mutex_unlock(&j->lock);
+}
+
+void journalClose(int discard) // stops the writer, removing the journal when its edits are saved or abandoned
+{
+  struct journal_state *j = &E.journal;
+  if (!j->on)
+    return;
+  pthread_mutex_lock(&j->lock);
+  if (discard)
+  {
+    j->batch.len = 0;
+    j->last.op = 0;
+  }
+  j->stop = 1;
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+  pthread_join(j->thread, NULL);
+  close(j->fd);
+  j->fd = -1;
+  if (discard)
+    unlink(j->path);
+  j->on = 0;
+}
+
+int journalApply(struct journal_rec *r) // makes a recorded change again, -1 if it does not fit the buffer
+{
+  long long need = r->op == J_ROW_DELETE ? r->y + r->n - 1 : r->y;
+  while (need >= E.numrows && editorIndexing()) // rows only go in after the ones still loading
+    editorIndexWait();
+  if (r->op == J_ROW_INSERT)
+  {
+    if (r->y > E.numrows)
+      return -1;
+    editorInsertRow(r->y, r->text, r->n);
+    return 0;
+  }
+  if (need >= E.numrows)
+    return -1;
+  long long size = editorRowAt(r->y)->size;
+  if (r->op == J_INSERT && r->a <= size)
+    editorRowInsertBytes(r->y, r->a, r->text, r->n);
+  else if (r->op == J_DELETE && r->a + r->n <= size)
+    editorRowDelBytes(r->y, r->a, r->n);
+  else if (r->op == J_ROW_DELETE)
+    while (r->n-- > 0)
+      editorDelRow(r->y);
+  else
+    return -1;
+  return 0;
+}
+
+int journalOwnerAlive(struct journal_header *h) // whether the lexi that wrote h is still running
+{
+  if (kill(h->pid, 0) == -1 && errno != EPERM) // EPERM: it runs, as another user
+    return 0;
+  if (h->boot[0] && strncmp(h->boot, E.journal.base.boot, sizeof(h->boot)) != 0)
+    return 0; // written before a reboot, the pid is someone else's now
+  long long start = journalStartTime(h->pid);
+  return h->pid_start == 0 || start == 0 || start == h->pid_start;
+}
+
+void journalRecover() // replays the journal a lexi editing this file left behind
+{
+  struct journal_state *j = &E.journal;
+  journalBase();
+  j->failed = 0;
+  char *path = journalPath(E.filename);
+  int fd = open(path, O_RDWR);
+  struct journal_header h;
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || read(fd, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, j->base.magic, 8))
+  {
+    if (fd != -1)
+      close(fd);
+    free(path);
+    return;
+  }
+  if (h.pid != getpid() && journalOwnerAlive(&h))
+  {
+    editorSetStatusMessage("%s is being edited by process %lld, edits are not journaled", E.filename, h.pid);
+    j->failed = 1;
+    close(fd);
+    free(path);
+    return;
+  }
+  if (h.size != j->base.size || h.mtime != j->base.mtime || h.mtime_ns != j->base.mtime_ns || h.ino != j->base.ino)
+  {
+    char old[PATH_MAX];
+    snprintf(old, sizeof(old), "%s~", path);
+    rename(path, old);
+    editorSetStatusMessage("The file changed since %s was written, moved it to %s", path, old);
+    close(fd);
+    free(path);
+    return;
+  }
+  char *buf = malloc(st.st_size);
+  if (buf == NULL)
+    die("malloc");
+  long long size = pread(fd, buf, st.st_size, 0);
+  const char *p = buf + sizeof(h), *next;
+  struct journal_rec r;
+  long long count = 0;
+  j->replaying = 1;
+  while ((next = journalDecode(p, buf + (size > 0 ? size : 0), &r)) != NULL && journalApply(&r) == 0)
+  {
+    p = next;
+    count++;
+  }
+  j->replaying = 0;
+  long long valid = p - buf; // a record torn by the crash is cut off
+  free(buf);
+  j->base.pid = getpid();
+  if (ftruncate(fd, valid) == -1 || pwrite(fd, &j->base, sizeof(j->base), 0) != sizeof(j->base) ||
+      lseek(fd, valid, SEEK_SET) == -1)
+  {
+    close(fd);
+    free(path);
+    return;
+  }
+  free(j->path);
+  j->path = path;
+  journalRun(fd, valid);
+  E.dirty = count;
+  editorSetStatusMessage("Recovered %lld unsaved edits from %s", count, path);
+}
+
+/*** file i/o ***/
+
+int editorOpenMapped(char *filename) // maps a regular file and has the loader index it
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+  {
+    close(fd);
+    return -1;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping keeps the file alive
+  if (map == MAP_FAILED)
+    return -1;
+  E.map = map;
+  E.maplen = st.st_size;
+  E.mapindexed = 0;
+  char *last = memrchr(map, '\n', st.st_size);
+  E.follow.off = last ? last - map + 1 : 0;
+  E.follow.partial = E.follow.off < st.st_size ? map + E.follow.off : NULL;
+  loadStart(-1, st.st_size);
+  editorIndexWait();
+  return 0;
+}
+
+void editorOpen(char *filename)
+{
+  // allows the user to open a file
+  free(E.filename);
+  E.filename = strdup(filename);
+  undoClear();
+  editorSelectSyntaxHighlight();
+  if (E.follow.on || editorOpenMapped(filename) != 0) // a followed file may be truncated, which faults a mapping
+  {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+      die("open");
+    struct stat st;
+    loadStart(fd, fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0);
+    editorIndexWait();
+  }
+  E.dirty = 0;
+  journalRecover();
+}
+
+void editorOpenStream(int fd) // reads the buffer from a pipe as it comes in; it has no file, so no journal
+{
+  free(E.filename);
+  E.filename = NULL;
+  undoClear();
+  editorSelectSyntaxHighlight();
+  loadStart(fd, 0);
+  editorIndexWait(); // shows what the pipe already holds without waiting on a quiet one
+  E.dirty = 0;
+}
+
+// Saving streams the rows straight from the buffer with writev, so no copy
+// of the file is ever assembled. Unedited rows that still view the mapping
+// are written together with their newline, neighbouring pieces of the
+// mapping are merged into one iovec, and leaves that were never loaded go
+// out as a single range. The result lands in a temporary file next to the
+// original that is synced and then renamed over it, so a crash leaves either
+// the old or the new file and never a half written one.
+
+struct save_state
+{
+  int fd;
+  struct iovec iov[LEXI_IOV_BATCH];
+  int n;
+  long long written;
+};
+
+int saveFlush(struct save_state *sv)
+{
+  struct iovec *iov = sv->iov;
+  int n = sv->n;
+  while (n > 0)
+  {
+    ssize_t w = writev(sv->fd, iov, n);
+    if (w == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    sv->written += w;
+    while (n > 0 && (size_t)w >= iov->iov_len) // skip what went out, resume inside a partial iovec
+    {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  sv->n = 0;
+  return 0;
+}
+
+int saveAppend(struct save_state *sv, const char *s, size_t len)
+{
+  if (len == 0)
+    return 0;
+  if (sv->n > 0)
+  {
+    struct iovec *last = &sv->iov[sv->n - 1];
+    if ((char *)last->iov_base + last->iov_len == s) // contiguous with the previous piece
+    {
+      last->iov_len += len;
+      return 0;
+    }
+  }
+  if (sv->n == LEXI_IOV_BATCH && saveFlush(sv) == -1)
+    return -1;
+  sv->iov[sv->n].iov_base = (char *)s;
+  sv->iov[sv->n].iov_len = len;
+  sv->n++;
+  return 0;
+}
+
+int saveRows(struct save_state *sv)
+{
+  int j;
+  buffer_node *leaf;
+  for (leaf = bufLeafAt(0, &j); leaf; leaf = leaf->next)
+  {
+    if (leaf->rows == NULL && memchr(E.map + leaf->mapoff, '\r', leaf->mapend - leaf->mapoff) == NULL)
+    {
+      // an untouched piece of the file is already laid out the way it is saved
+      if (saveAppend(sv, E.map + leaf->mapoff, leaf->mapend - leaf->mapoff) == -1)
+        return -1;
+      if (E.map[leaf->mapend - 1] != '\n' && saveAppend(sv, "\n", 1) == -1)
+        return -1;
+      continue;
+    }
+    bufLoadLeaf(leaf);
+    for (j = 0; j < leaf->n; j++)
+    {
+      editor_row *row = &leaf->rows[j];
+      int nl = row->mapped && row->chars + row->size < E.map + E.maplen && row->chars[row->size] == '\n';
+      if (saveAppend(sv, row->chars, row->size + nl) == -1)
+        return -1;
+      if (!nl && saveAppend(sv, "\n", 1) == -1)
+        return -1;
+    }
+  }
+  return saveFlush(sv);
+}
+
+void editorSave() // save the file to the disk
+{
+  char *copy = NULL;
+  if (E.readonly) // a pager leaves the file it shows alone and saves a copy elsewhere
+  {
+    copy = editorPrompt("Save a copy as: %s (ESC to cancel)", NULL, 0);
+    if (copy == NULL)
+    {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    struct stat a, b;
+    if (E.filename && (strcmp(copy, E.filename) == 0 ||
+                       (stat(copy, &a) == 0 && stat(E.filename, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino)))
+    {
+      editorSetStatusMessage("%s is the file being viewed, not saved", copy);
+      free(copy);
+      return;
+    }
+  }
+  else if (E.filename == NULL)
+  {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+    if (E.filename == NULL)
+    {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  int partial = editorIndexing() && E.load.stream; // a pipe may never end, so what came so far is saved
+  if (partial)
+    editorIndexPublish(0);
+  else
+    editorIndexAll();
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  char *name = copy ? copy : E.filename;
+  char *target = realpath(name, NULL); // write through symlinks rather than replacing them
+  if (target == NULL)
+    target = strdup(name);
+  char tmpname[PATH_MAX];
+  snprintf(tmpname, sizeof(tmpname), "%s.lexi-XXXXXX", target);
+  struct stat st;
+  mode_t mode;
+  if (stat(target, &st) == 0)
+  {
+    mode = st.st_mode & 07777;
+  }
+  else
+  {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0644 & ~mask;
+  }
+  struct save_state sv;
+  sv.n = 0;
+  sv.written = 0;
+  sv.fd = mkstemp(tmpname);
+  if (sv.fd != -1)
+  {
+    if (fchmod(sv.fd, mode) != -1 && saveRows(&sv) != -1 && fsync(sv.fd) != -1 &&
+        close(sv.fd) != -1 && rename(tmpname, target) != -1)
+    {
+      char *slash = strrchr(target, '/'); // make the rename itself durable
+      if (slash)
+        *slash = '\0';
+      int dirfd = open(slash ? (slash == target ? "/" : target) : ".", O_RDONLY);
+      if (dirfd != -1)
+      {
+        fsync(dirfd);
+        close(dirfd);
+      }
+      free(target);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      if (copy) // the buffer still shows the file it was opened from
+      {
+        editorSetStatusMessage("Saved a copy to %s (%lld bytes)", copy, sv.written);
+        free(copy);
+        return;
+      }
+      E.dirty = 0;
+      journalClose(1); // the file now holds every edit
+      journalBase();
+      if (E.follow.on) // the buffer is the file now, carry on from its end
+      {
+        E.follow.off = sv.written;
+        E.follow.partial = NULL;
+        followAttach();
+      }
+      if (partial)
+        editorSetStatusMessage("Saved the %lld lines read so far (%lld bytes), more are still coming in",
+                               E.numrows, sv.written);
+      else
+        editorSetStatusMessage("%lld bytes written to disk in %.2fs (%.1f MB/s)", sv.written, secs,
+                               secs > 0 ? sv.written / secs / (1024 * 1024) : 0.0);
+      return;
+    }
+    int saved_errno = errno;
+    close(sv.fd);
+    unlink(tmpname);
+    errno = saved_errno;
+  }
+  free(target);
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  free(copy);
+}
+/*** follow ***/
+
+// Following a file (-f or Ctrl-T) appends whatever gets written to it. Only
+// the bytes past the last complete line are read, straight into the load
+// arena, and each line becomes a row viewing that arena. A last line that is
+// still being written shows as a row that is read again once it grows.
+// inotify says when to look; without it the file is checked every
+// LEXI_FOLLOW_MS. A file that shrank or was replaced is reloaded.
+
+void followDetach()
+{
+  struct follow_state *f = &E.follow;
+  if (f->fd != -1)
+    close(f->fd);
+  if (f->ifd != -1)
+    close(f->ifd); // drops its watches too
+  f->fd = f->ifd = -1;
+}
+
+int followAttach() // opens the file being followed and starts watching it
+{
+  struct follow_state *f = &E.follow;
+  struct stat st;
+  followDetach();
+  f->fd = open(E.filename, O_RDONLY);
+  if (f->fd == -1 || fstat(f->fd, &st) == -1)
+  {
+    followDetach();
+    return -1;
+  }
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+#if defined(__linux__)
+  f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->ifd != -1)
+  {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", E.filename);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+      *slash = '\0';
+    if (inotify_add_watch(f->ifd, E.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) == -1 ||
+        inotify_add_watch(f->ifd, slash ? (slash == dir ? "/" : dir) : ".", IN_CREATE | IN_MOVED_TO) == -1)
+    {
+      close(f->ifd); // fall back to checking with fstat
+      f->ifd = -1;
+    }
+  }
+#endif
+  return 0;
+}
+
+long long followRead()
+{
+  // appends the complete lines written since the last call, at most
+  // LEXI_FOLLOW_CHUNK bytes of them, and returns how many rows came in
+  struct follow_state *f = &E.follow;
+  struct stat st;
+  if (fstat(f->fd, &st) == -1 || st.st_size <= f->off)
+  {
+    f->more = 0;
+    return 0;
+  }
+  editor_row *last = E.numrows > 0 ? editorRowAt(E.numrows - 1) : NULL;
+  if (f->partial && (last == NULL || last->cap != 0 || last->chars != f->partial))
+  {
+    // the unfinished line was edited or moved, so the rest of it has no row to go to
+    followStop();
+    editorSetStatusMessage("The last line of %s was edited, stopped following", E.filename);
+    E.redraw = 1;
+    return 0;
+  }
+  long long want = st.st_size - f->off;
+  if (want > LEXI_FOLLOW_CHUNK)
+    want = LEXI_FOLLOW_CHUNK;
+  char *buf = arenaAlloc(want + 1);
+  ssize_t got = pread(f->fd, buf, want, f->off);
+  if (got > 0 && memchr(buf, '\n', got) == NULL && f->off + got < st.st_size)
+  {
+    want = st.st_size - f->off; // one line longer than a chunk, it has to be read whole
+    buf = arenaAlloc(want + 1);
+    got = pread(f->fd, buf, want, f->off);
+  }
+  if (got <= 0)
+    return 0;
+  long long first = E.numrows;
+  if (f->partial) // the unfinished line is read again with the rest
+  {
+    editorFreerow(last);
+    bufDeleteRow(E.numrows - 1);
+    E.numrows--;
+    first--;
+  }
+  f->partial = NULL;
+  char *p = buf, *end = buf + got;
+  while (p < end)
+  {
+    char *nl = memchr(p, '\n', end - p);
+    char *eol = nl ? nl : end;
+    while (eol > p && eol[-1] == '\r')
+      eol--;
+    *eol = '\0';
+    editor_row row;
+    row.size = eol - p;
+    row.cap = 0;
+    row.mapped = 0;
+    row.chars = p;
+    row.rslot = -1;
+    row.hl_end = -1;
+    bufInsertRow(E.numrows, &row);
+    E.alloc.ops[ALLOC_LOAD]++;
+    E.numrows++;
+    if (nl == NULL)
+    {
+      f->partial = p;
+      break;
+    }
+    p = nl + 1;
+  }
+  f->more = f->off + got < st.st_size;
+  f->off += (f->partial ? f->partial : end) - buf;
+  return E.numrows - first;
+}
+
+void editorReload() // drops the buffer and reads the file again
+{
+  char *filename = strdup(E.filename);
+  int at_end = E.cursor_y >= E.numrows - 1;
+  searchCancel();
+  loadCancel();
+  bufFreeTree(E.buf);
+  E.buf = bufNewNode(1);
+  E.numrows = 0;
+  arenaFreeAll();
+  if (E.map)
+    munmap(E.map, E.maplen);
+  E.map = NULL;
+  E.maplen = E.mapindexed = 0;
+  editorOpen(filename);
+  free(filename);
+  if (at_end)
+    editorIndexAll();
+  if (at_end || E.cursor_y > editorLastCursorY())
+    E.cursor_y = editorLastCursorY();
+  E.cursor_x = 0;
+}
+
+void followPoll() // reads what was appended to the followed file, reloading it if it shrank or was replaced
+{
+  struct follow_state *f = &E.follow;
+#if defined(__linux__)
+  char events[4096];
+  if (f->ifd != -1)
+    while (read(f->ifd, events, sizeof(events)) > 0) // they only say when to look
+      ;
+#endif
+  f->retry = editorIndexing() || E.search.nchunks; // rows only go after the indexed ones and not under a search
+  if (f->retry)
+    return;
+  struct stat st, now;
+  char nl = '\n';
+  int shrunk = fstat(f->fd, &st) == 0 && st.st_size < f->off;
+  if (!shrunk && f->off > 0 && (pread(f->fd, &nl, 1, f->off - 1) != 1 || nl != '\n'))
+    shrunk = 1; // truncated and written again past where we were
+  int replaced = stat(E.filename, &now) == 0 && (now.st_ino != f->ino || now.st_dev != f->dev);
+  if (!shrunk && !replaced)
+  {
+    int at_end = E.cursor_y >= E.numrows - 1;
+    if (followRead() > 0)
+    {
+      if (at_end)
+      {
+        E.cursor_y = E.numrows - 1;
+        E.cursor_x = 0;
+      }
+      E.redraw = 1;
+    }
+    return;
+  }
+  if (E.dirty)
+  {
+    followStop();
+    editorSetStatusMessage("%s was %s, stopped following to keep your changes", E.filename, shrunk ? "truncated" : "replaced");
+  }
+  else
+  {
+    editorReload();
+    if (followAttach() == 0 && followRead() > 0) // lines written while the file was being read again
+      E.cursor_y = E.numrows - 1;
+    editorSetStatusMessage("%s was %s, reloaded", E.filename, shrunk ? "truncated" : "replaced");
+  }
+  E.redraw = 1;
+}
+
+void followUnmap() // once the file is indexed, moves the rows viewing the mapping into the arena and unmaps it
+{
+  if (E.map == NULL)
+    return;
+  searchCancel(); // no worker may be reading the mapping when it goes
+  int j;
+  buffer_node *leaf;
+  for (leaf = bufLeafAt(0, &j); leaf; leaf = leaf->next)
+  {
+    bufLoadLeaf(leaf);
+    for (j = 0; j < leaf->n; j++)
+    {
+      editor_row *row = &leaf->rows[j];
+      if (!row->mapped)
+        continue;
+      char *copy = arenaCopy(row->chars, row->size);
+      if (row->chars == E.follow.partial)
+        E.follow.partial = copy;
+      row->chars = copy;
+      row->mapped = 0;
+    }
+  }
+  munmap(E.map, E.maplen);
+  E.map = NULL;
+  E.maplen = E.mapindexed = 0;
+}
+
+void followStart()
+{
+  if (E.filename == NULL || followAttach() == -1)
+  {
+    editorSetStatusMessage("Nothing to follow%s%s", E.filename ? ": " : "", E.filename ? strerror(errno) : "");
+    E.follow.on = 0;
+    return;
+  }
+  E.follow.on = 1;
+  editorIndexAll();
+  followUnmap(); // a copytruncate rotation would turn every mapped row into a SIGBUS
+  E.cursor_y = editorLastCursorY();
+  E.cursor_x = 0;
+  followPoll();
+  editorSetStatusMessage("Following %s (Ctrl-T to stop)", E.filename);
+}
+
+void followStop()
+{
+  followDetach();
+  E.follow.on = 0;
+  E.follow.more = E.follow.retry = 0;
+}
+
+/*** regex ***/
+
+// Patterns are parsed into a tree, compiled into a Thompson NFA and run
+// through DFAs whose states are only built when a scan first reaches them, so
+// every byte of a row is looked at a bounded number of times and nothing ever
+// backtracks. Compiled patterns and their DFA states are kept across searches.
+
+struct re_parser
+{
+  const char *p;
+  const char *err;
+};
+
+struct re_tree *reTree(int kind, struct re_tree *a, struct re_tree *b)
+{
+  struct re_tree *t = calloc(1, sizeof(struct re_tree));
+  if (t == NULL)
+    die("calloc");
+  t->kind = kind;
+  t->a = a;
+  t->b = b;
+  return t;
+}
+
+void reTreeFree(struct re_tree *t)
+{
+  if (t == NULL)
+    return;
+  reTreeFree(t->a);
+  reTreeFree(t->b);
+  free(t);
+}
+
+void reSetAdd(unsigned char *set, int lo, int hi)
+{
+  int c;
+  for (c = lo; c <= hi; c++)
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+int reSetClass(unsigned char *set, int c) // adds \d \w \s and friends, returns 0 if `c` is no class
+{
+  unsigned char cls[32];
+  int i;
+  memset(cls, 0, sizeof(cls));
+  switch (tolower(c))
+  {
+  case 'd':
+    reSetAdd(cls, '0', '9');
+    break;
+  case 'w':
+    reSetAdd(cls, '0', '9');
+    reSetAdd(cls, 'a', 'z');
+    reSetAdd(cls, 'A', 'Z');
+    reSetAdd(cls, '_', '_');
+    break;
+  case 's':
+    reSetAdd(cls, ' ', ' ');
+    reSetAdd(cls, '\t', '\r');
+    break;
+  default:
+    return 0;
+  }
+  for (i = 0; i < 32; i++)
+    set[i] |= isupper(c) ? ~cls[i] : cls[i];
+  return 1;
+}
+
+int reEscape(int c) // byte an escape stands for
+{
+  switch (c)
+  {
+  case 't':
+    return '\t';
+  case 'r':
+    return '\r';
+  case 'f':
+    return '\f';
+  case 'v':
+    return '\v';
+  case 'e':
+    return '\x1b';
+  }
+  return c;
+}
+
+struct re_tree *reParseAlt(struct re_parser *ps);
+
+struct re_tree *reParseClass(struct re_parser *ps) // after the [
+{
+  struct re_tree *t = reTree(RT_SET, NULL, NULL);
+  int negate = 0, first = 1, i;
+  if (*ps->p == '^')
+  {
+    negate = 1;
+    ps->p++;
+  }
+  while (*ps->p != ']' || first)
+  {
+    int lo = (unsigned char)*ps->p++;
+    first = 0;
+    if (lo == '\0')
+    {
+      ps->err = "missing ]";
+      return t;
+    }
+    if (lo == '\\')
+    {
+      if (*ps->p == '\0')
+        continue;
+      lo = (unsigned char)*ps->p++;
+      if (reSetClass(t->set, lo))
+        continue;
+      lo = reEscape(lo);
+    }
+    int hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0')
+    {
+      ps->p++;
+      hi = (unsigned char)*ps->p++;
+      if (hi == '\\' && *ps->p)
+        hi = reEscape((unsigned char)*ps->p++);
+      if (hi < lo)
+      {
+        ps->err = "bad range";
+        return t;
+      }
+    }
+    reSetAdd(t->set, lo, hi);
+  }
+  ps->p++;
+  if (negate)
+    for (i = 0; i < 32; i++)
+      t->set[i] = ~t->set[i];
+  return t;
+}
+
+struct re_tree *reParseAtom(struct re_parser *ps)
+{
+  struct re_tree *t;
+  int c = (unsigned char)*ps->p++;
+  switch (c)
+  {
+  case '(':
+    if (ps->p[0] == '?' && ps->p[1] == ':')
+      ps->p += 2;
+    t = reParseAlt(ps);
+    if (*ps->p != ')')
+      ps->err = "missing )";
+    else
+      ps->p++;
+    return t;
+  case '[':
+    return reParseClass(ps);
+  case '^':
+    return reTree(RT_BOL, NULL, NULL);
+  case '$':
+    return reTree(RT_EOL, NULL, NULL);
+  case '*':
+  case '+':
+  case '?':
+  case '{':
+    ps->err = "nothing to repeat";
+    return reTree(RT_EMPTY, NULL, NULL);
+  }
+  t = reTree(RT_SET, NULL, NULL);
+  if (c == '.')
+  {
+    reSetAdd(t->set, 0, 255);
+  }
+  else if (c == '\\')
+  {
+    if (*ps->p == '\0')
+    {
+      ps->err = "trailing \\";
+      return t;
+    }
+    c = (unsigned char)*ps->p++;
+    if (!reSetClass(t->set, c))
+      reSetAdd(t->set, reEscape(c), reEscape(c));
+  }
+  else
+  {
+    reSetAdd(t->set, c, c);
+  }
+  return t;
+}
+
+int reParseCount(struct re_parser *ps)
+{
+  int n = 0;
+  if (!isdigit((unsigned char)*ps->p))
+    return -1;
+  while (isdigit((unsigned char)*ps->p) && n <= LEXI_REGEX_REPEAT)
+    n = n * 10 + (*ps->p++ - '0');
+  return n;
+}
+
+struct re_tree *reParseRepeat(struct re_parser *ps)
+{
+  struct re_tree *t = reParseAtom(ps);
+  while (!ps->err && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?' || *ps->p == '{'))
+  {
+    int min = 0, max = -1;
+    char c = *ps->p++;
+    if (c == '+')
+      min = 1;
+    else if (c == '?')
+      max = 1;
+    else if (c == '{')
+    {
+      min = max = reParseCount(ps);
+      if (*ps->p == ',')
+      {
+        ps->p++;
+        max = *ps->p == '}' ? -1 : reParseCount(ps);
+      }
+      if (min < 0 || (max >= 0 && max < min) || *ps->p != '}')
+        ps->err = "bad {}";
+      else if (min > LEXI_REGEX_REPEAT || max > LEXI_REGEX_REPEAT)
+        ps->err = "repeat count too large";
+      if (*ps->p == '}') // after "bad {}" p may be at the end of the pattern
+        ps->p++;
+    }
+    if (*ps->p == '?') // lazy and greedy repeats find the same lines
+      ps->p++;
+    t = reTree(RT_REPEAT, t, NULL);
+    t->min = min;
+    t->max = max;
+  }
+  return t;
+}
+
+struct re_tree *reParseCat(struct re_parser *ps)
+{
+  struct re_tree *t = NULL;
+  while (!ps->err && *ps->p && *ps->p != '|' && *ps->p != ')')
+  {
+    struct re_tree *f = reParseRepeat(ps);
+    t = t ? reTree(RT_CAT, t, f) : f;
+  }
+  return t ? t : reTree(RT_EMPTY, NULL, NULL);
+}
+
+struct re_tree *reParseAlt(struct re_parser *ps)
+{
+  struct re_tree *t = reParseCat(ps);
+  while (!ps->err && *ps->p == '|')
+  {
+    ps->p++;
+    t = reTree(RT_ALT, t, reParseCat(ps));
+  }
+  return t;
+}
+
+int reNode(struct re_prog *p, int op, int out, int out1)
+{
+  if (p->n == LEXI_REGEX_NODES)
+  {
+    p->full = 1;
+    return 0;
+  }
+  if (p->n == p->cap)
+  {
+    p->cap = p->cap ? p->cap * 2 : 64;
+    p->nodes = realloc(p->nodes, sizeof(struct re_node) * p->cap);
+    if (p->nodes == NULL)
+      die("realloc");
+  }
+  struct re_node *nd = &p->nodes[p->n];
+  nd->op = op;
+  nd->out = out;
+  nd->out1 = out1;
+  memset(nd->set, 0, sizeof(nd->set));
+  return p->n++;
+}
+
+int reEmit(struct re_prog *p, struct re_tree *t, int next, int reverse)
+{
+  // emits the instructions for `t` followed by `next` and returns the first;
+  // a reversed program matches the text read from right to left
+  int s, i;
+  switch (t->kind)
+  {
+  case RT_SET:
+    s = reNode(p, RO_SET, next, -1);
+    memcpy(p->nodes[s].set, t->set, sizeof(t->set));
+    return s;
+  case RT_BOL:
+    return reNode(p, reverse ? RO_EOL : RO_BOL, next, -1);
+  case RT_EOL:
+    return reNode(p, reverse ? RO_BOL : RO_EOL, next, -1);
+  case RT_CAT:
+    if (reverse)
+      return reEmit(p, t->b, reEmit(p, t->a, next, 1), 1);
+    return reEmit(p, t->a, reEmit(p, t->b, next, 0), 0);
+  case RT_ALT:
+    s = reEmit(p, t->a, next, reverse);
+    return reNode(p, RO_SPLIT, s, reEmit(p, t->b, next, reverse));
+  case RT_REPEAT:
+    if (t->max < 0)
+    {
+      s = reNode(p, RO_SPLIT, -1, next);
+      i = reEmit(p, t->a, s, reverse);
+      p->nodes[s].out = i;
+      next = s;
+    }
+    else
+    {
+      for (i = t->min; i < t->max && !p->full; i++)
+      {
+        s = reEmit(p, t->a, next, reverse);
+        next = reNode(p, RO_SPLIT, s, next);
+      }
+    }
+    for (i = 0; i < t->min && !p->full; i++)
+      next = reEmit(p, t->a, next, reverse);
+    return next;
+  }
+  return next;
+}
+
+void reCompile(struct re_prog *p, struct re_tree *t, int reverse)
+{
+  p->nodes = NULL;
+  p->n = p->cap = 0;
+  p->full = 0;
+  p->start = reEmit(p, t, reNode(p, RO_MATCH, -1, -1), reverse);
+}
+
+void dfaClosure(struct dfa *d, int node, int consumed, int *n, int bol, int eol)
+{
+  // adds the instructions reachable from `node` without reading a byte;
+  // line anchors are only passed when `bol` or `eol` says they hold
+  int sp = 0;
+  d->stack[sp++] = node * 2 + consumed;
+  while (sp > 0)
+  {
+    int x = d->stack[--sp];
+    if (x < 0 || d->mark[x] == d->gen)
+      continue;
+    d->mark[x] = d->gen;
+    struct re_node *nd = &d->prog->nodes[x >> 1];
+    int bit = x & 1;
+    switch (nd->op)
+    {
+    case RO_SPLIT:
+      d->stack[sp++] = nd->out1 * 2 + bit;
+      d->stack[sp++] = nd->out * 2 + bit;
+      break;
+    case RO_BOL:
+      if (bol)
+        d->stack[sp++] = nd->out * 2 + bit;
+      break;
+    case RO_EOL:
+      if (eol)
+        d->stack[sp++] = nd->out * 2 + bit;
+      else
+        d->list[(*n)++] = x; // kept for the end of line check
+      break;
+    default:
+      d->list[(*n)++] = x;
+    }
+  }
+}
+
+int dfaIntCmp(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+unsigned dfaHash(const int *set, int n)
+{
+  unsigned h = 2166136261u;
+  int i;
+  for (i = 0; i < n; i++)
+    h = (h ^ (unsigned)set[i]) * 16777619u;
+  return h;
+}
+
+void dfaFlush(struct dfa *d) // drops every state once the cache is full
+{
+  int i;
+  for (i = 0; i < d->nstates; i++)
+  {
+    free(d->states[i]->set);
+    free(d->states[i]);
+  }
+  d->nstates = 0;
+  memset(d->table, 0, sizeof(int) * LEXI_DFA_STATES * 2);
+  d->start[0] = d->start[1] = -1;
+  d->flushes++;
+}
+
+int dfaAdd(struct dfa *d, int n)
+{
+  // returns the state holding the n instructions in d->list, making it if new
+  int i, h;
+  qsort(d->list, n, sizeof(int), dfaIntCmp);
+  unsigned hash = dfaHash(d->list, n);
+  for (h = hash & (LEXI_DFA_STATES * 2 - 1); d->table[h]; h = (h + 1) & (LEXI_DFA_STATES * 2 - 1))
+  {
+    struct dfa_state *s = d->states[d->table[h] - 1];
+    if (s->n == n && memcmp(s->set, d->list, sizeof(int) * n) == 0)
+      return d->table[h] - 1;
+  }
+  if (d->nstates == LEXI_DFA_STATES)
+  {
+    dfaFlush(d);
+    for (h = hash & (LEXI_DFA_STATES * 2 - 1); d->table[h]; h = (h + 1) & (LEXI_DFA_STATES * 2 - 1))
+      ;
+  }
+  struct dfa_state *s = malloc(sizeof(struct dfa_state));
+  if (s == NULL || (s->set = malloc(sizeof(int) * (n ? n : 1))) == NULL)
+    die("malloc");
+  memcpy(s->set, d->list, sizeof(int) * n);
+  s->n = n;
+  s->accept = 0;
+  memset(s->next, -1, sizeof(s->next));
+  int m = 0;
+  d->gen++;
+  for (i = 0; i < n; i++)
+  {
+    struct re_node *nd = &d->prog->nodes[s->set[i] >> 1];
+    if (nd->op == RO_MATCH && ((s->set[i] & 1) || !d->unanchored))
+      s->accept = 1;
+    else if (nd->op == RO_EOL)
+      dfaClosure(d, nd->out, s->set[i] & 1, &m, 0, 1);
+  }
+  s->accept_eol = s->accept;
+  for (i = 0; i < m; i++)
+    if (d->prog->nodes[d->list[i] >> 1].op == RO_MATCH && ((d->list[i] & 1) || !d->unanchored))
+      s->accept_eol = 1;
+  d->states[d->nstates] = s;
+  d->table[h] = ++d->nstates;
+  return d->nstates - 1;
+}
+
+int dfaStart(struct dfa *d, int bol)
+{
+  if (d->start[bol] < 0)
+  {
+    int n = 0;
+    d->gen++;
+    dfaClosure(d, d->prog->start, 0, &n, bol, 0);
+    int s = dfaAdd(d, n);
+    d->start[bol] = s;
+  }
+  return d->start[bol];
+}
+
+int dfaStep(struct dfa *d, int s, unsigned char c)
+{
+  struct dfa_state *st = d->states[s];
+  int t = st->next[c];
+  if (t >= 0)
+    return t;
+  int n = 0, i;
+  d->gen++;
+  for (i = 0; i < st->n; i++)
+  {
+    struct re_node *nd = &d->prog->nodes[st->set[i] >> 1];
+    if (nd->op == RO_SET && (nd->set[c >> 3] & (1 << (c & 7))))
+      dfaClosure(d, nd->out, 1, &n, 0, 0);
+  }
+  if (d->unanchored)
+    dfaClosure(d, d->prog->start, 0, &n, 0, 0);
+  unsigned flushes = d->flushes;
+  t = dfaAdd(d, n);
+  if (d->flushes == flushes) // st is gone if the cache was flushed
+    st->next[c] = t;
+  return t;
+}
+
+struct dfa *regexDfa(struct regex *re, int worker, int kind)
+{
+  // kind 0 finds whether a line has a match, 1 reads it backwards for where
+  // matches start, 2 goes on from a start to the longest end
+  struct dfa *d = &re->dfas[worker * 3 + kind];
+  if (d->states == NULL)
+  {
+    d->prog = kind == 1 ? &re->rev : &re->fwd;
+    d->unanchored = kind != 2;
+    d->states = malloc(sizeof(struct dfa_state *) * LEXI_DFA_STATES);
+    d->table = calloc(LEXI_DFA_STATES * 2, sizeof(int));
+    d->mark = calloc(d->prog->n * 2, sizeof(unsigned));
+    d->stack = malloc(sizeof(int) * (d->prog->n * 4 + 2));
+    d->list = malloc(sizeof(int) * d->prog->n * 2);
+    if (d->states == NULL || d->table == NULL || d->mark == NULL || d->stack == NULL || d->list == NULL)
+      die("malloc");
+    d->nstates = 0;
+    d->gen = 0;
+    d->start[0] = d->start[1] = -1;
+    if (kind == 2 && (d->trace = calloc(LEXI_REGEX_TRACE, sizeof(struct dfa_trace))) == NULL)
+      die("calloc");
+    d->scans = d->valid = 1; // the zeroed entries are stale
+  }
+  return d;
+}
+
+struct regex *regexCompile(const char *pattern, const char **err)
+{
+  struct re_parser ps = {pattern, NULL};
+  struct re_tree *t = reParseAlt(&ps);
+  if (!ps.err && *ps.p == ')')
+    ps.err = "unmatched )";
+  struct regex *re = NULL;
+  if (!ps.err)
+  {
+    re = calloc(1, sizeof(struct regex));
+    if (re == NULL || (re->dfas = calloc(LEXI_SEARCH_THREADS * 3, sizeof(struct dfa))) == NULL)
+      die("calloc");
+    re->pattern = strdup(pattern);
+    reCompile(&re->fwd, t, 0);
+    reCompile(&re->rev, t, 1);
+    if (re->fwd.full || re->rev.full)
+      ps.err = "pattern too large";
+  }
+  reTreeFree(t);
+  *err = ps.err;
+  if (ps.err && re)
+  {
+    regexFree(re);
+    re = NULL;
+  }
+  return re;
+}
+
+void regexFree(struct regex *re)
+{
+  int i;
+  for (i = 0; i < LEXI_SEARCH_THREADS * 3; i++)
+  {
+    struct dfa *d = &re->dfas[i];
+    if (d->states == NULL)
+      continue;
+    dfaFlush(d);
+    free(d->states);
+    free(d->table);
+    free(d->mark);
+    free(d->stack);
+    free(d->list);
+    free(d->trace);
+    free(d->starts);
+  }
+  free(re->dfas);
+  free(re->fwd.nodes);
+  free(re->rev.nodes);
+  free(re->pattern);
+  free(re);
+}
+
+void regexStarts(struct dfa *rev, const char *s, long long len)
+{
+  // one pass from the end of the line to its start sets the bit of each byte
+  // a nonempty match starts at, wherever that match ends
+  if (len / 8 + 1 > rev->startscap)
+  {
+    rev->startscap = len / 8 + 1;
+    free(rev->starts);
+    if ((rev->starts = malloc(rev->startscap)) == NULL)
+      die("malloc");
+  }
+  memset(rev->starts, 0, len / 8 + 1);
+  int r = dfaStart(rev, 1);
+  long long j;
+  for (j = len; j > 0; j--)
+  {
+    r = dfaStep(rev, r, s[j - 1]);
+    struct dfa_state *st = rev->states[r];
+    if (st->accept || (j == 1 && st->accept_eol))
+      rev->starts[(j - 1) >> 3] |= 1 << ((j - 1) & 7);
+  }
+  rev->startsline = 1;
+}
+
+long long regexLongest(struct dfa *ext, const char *s, long long len, long long start, long long end)
+{
+  // end of the longest match starting at `start`, one is known to end at
+  // `end`. A scan that reaches the state an earlier scan of the line had
+  // after the same byte has the same future, so it stops there and takes the
+  // end that scan found. Otherwise a line of short matches that could each
+  // grow to the end of the line (a.*b|a) would be read to its end per match.
+  // Starts only move right along a line, so the valid entries form one chain
+  int x = dfaStart(ext, start == 0);
+  unsigned long long scan = ++ext->scans;
+  unsigned flushes = ext->flushes; // state numbers mean nothing across a flush
+  long long k;
+  for (k = start; k < len; k++)
+  {
+    x = dfaStep(ext, x, s[k]);
+    struct dfa_state *st = ext->states[x];
+    if ((st->accept || (k + 1 == len && st->accept_eol)) && k + 1 > end)
+      end = k + 1;
+    struct dfa_trace *t = &ext->trace[k % LEXI_REGEX_TRACE];
+    if (t->pos == k && t->scan >= ext->valid && t->state == x && ext->flushes == flushes)
+    {
+      if (ext->tracelast > k + 1 && ext->tracelast > end)
+        end = ext->tracelast;
+      if (k >= start + LEXI_REGEX_TRACE) // the entries this scan did not replace are off the chain
+        ext->valid = scan + 1;
+      ext->tracelast = end;
+      return end;
+    }
+    if (k < start + LEXI_REGEX_TRACE) // the bytes right after a start are where later scans join
+    {
+      t->pos = k;
+      t->scan = scan;
+      t->state = x;
+    }
+    if (st->n == 0)
+      break;
+  }
+  ext->valid = ext->flushes == flushes ? scan : scan + 1;
+  ext->tracelast = end;
+  return end;
+}
+
+int regexMatch(struct regex *re, int worker, const char *s, long long len, long long from, long long *start, long long *end)
+{
+  // finds the nonempty match in s[from, len) that starts leftmost and of
+  // those the longest; s is one line. The forward DFA skips lines without
+  // a match, the first match of a line marks all the starts in it
+  struct dfa *rev = regexDfa(re, worker, 1);
+  struct dfa *ext = regexDfa(re, worker, 2);
+  if (from == 0) // a new line, the trace and the starts of the last one are stale
+  {
+    ext->valid = ++ext->scans;
+    rev->startsline = 0;
+  }
+  if (!rev->startsline)
+  {
+    struct dfa *fwd = regexDfa(re, worker, 0);
+    int f = dfaStart(fwd, from == 0);
+    long long i = from;
+    while (!fwd->states[f]->accept && !(i == len && fwd->states[f]->accept_eol))
+    {
+      if (i == len)
+        return 0;
+      f = dfaStep(fwd, f, s[i++]);
+    }
+    regexStarts(rev, s, len);
+  }
+  long long k;
+  for (k = from; k < len && !(rev->starts[k >> 3] & (1 << (k & 7))); k++)
+    ;
+  if (k == len)
+    return 0;
+  *start = k;
+  *end = regexLongest(ext, s, len, k, k);
+  return 1;
+}
+
+struct regex *regexGet(const char *pattern, const char **err)
+{
+  // compiled patterns are cached, so going back to an earlier query keeps its DFA states
+  struct search_state *st = &E.search;
+  int i, lru = 0;
+  for (i = 0; i < LEXI_REGEX_CACHE; i++)
+  {
+    if (st->regexes[i] && strcmp(st->regexes[i]->pattern, pattern) == 0)
+    {
+      st->regexes[i]->used = ++st->regex_clock;
+      return st->regexes[i];
+    }
+    if (st->regexes[i] == NULL || (st->regexes[lru] && st->regexes[i]->used < st->regexes[lru]->used))
+      lru = i;
+  }
+  struct regex *re = regexCompile(pattern, err);
+  if (re == NULL)
+    return NULL;
+  if (st->regexes[lru])
+    regexFree(st->regexes[lru]); // no worker is running, searchStart cancelled them
+  re->used = ++st->regex_clock;
+  st->regexes[lru] = re;
+  return re;
+}
+
+/*** find ***/
+
+// Searching scans the whole buffer once per query and records every match in
+// row order, so stepping to the next or previous match is a binary search in
+// that index. The buffer is cut into chunks of leaves that a pool of worker
+// threads scans in the background, nearest chunk first, while the prompt
+// stays responsive; typing another character cancels the search in flight.
+// Mapped leaves that have not been loaded are scanned as one contiguous piece
+// of the file. The scan itself looks for the first and last byte of the query
+// 16 or 32 bytes at a time and only compares the candidates.
+
+const char *searchScalar(const char *s, const char *end, const char *q, size_t qlen)
+{
+  while ((size_t)(end - s) >= qlen)
+  {
+    s = memchr(s, q[0], end - s - qlen + 1);
+    if (s == NULL)
+      return NULL;
+    if (memcmp(s + 1, q + 1, qlen - 1) == 0)
+      return s;
+    s++;
+  }
+  return NULL;
+}
+
+#if defined(__SSE2__)
+const char *searchSSE2(const char *s, const char *end, const char *q, size_t qlen)
+{
+  if (qlen < 2)
+    return searchScalar(s, end, q, qlen);
+  __m128i first = _mm_set1_epi8(q[0]);
+  __m128i last = _mm_set1_epi8(q[qlen - 1]);
+  while ((size_t)(end - s) >= qlen + 15)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)s);
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + qlen - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask)
+    {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(s + bit + 1, q + 1, qlen - 2) == 0)
+        return s + bit;
+      mask &= mask - 1;
+    }
+    s += 16;
+  }
+  return searchScalar(s, end, q, qlen);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) const char *searchAVX2(const char *s, const char *end, const char *q, size_t qlen)
+{
+  if (qlen < 2)
+    return searchScalar(s, end, q, qlen);
+  __m256i first = _mm256_set1_epi8(q[0]);
+  __m256i last = _mm256_set1_epi8(q[qlen - 1]);
+  while ((size_t)(end - s) >= qlen + 31)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *)s);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + qlen - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask)
+    {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(s + bit + 1, q + 1, qlen - 2) == 0)
+        return s + bit;
+      mask &= mask - 1;
+    }
+    s += 32;
+  }
+  return searchScalar(s, end, q, qlen);
+}
+#endif
+
+#if defined(__ARM_NEON)
+const char *searchNEON(const char *s, const char *end, const char *q, size_t qlen)
+{
+  if (qlen < 2)
+    return searchScalar(s, end, q, qlen);
+  uint8x16_t first = vdupq_n_u8(q[0]);
+  uint8x16_t last = vdupq_n_u8(q[qlen - 1]);
+  while ((size_t)(end - s) >= qlen + 15)
+  {
+    uint8x16_t a = vld1q_u8((const uint8_t *)s);
+    uint8x16_t b = vld1q_u8((const uint8_t *)(s + qlen - 1));
+    uint8x16_t eq = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0); // 4 bits per byte
+    while (mask)
+    {
+      int bit = __builtin_ctzll(mask) / 4;
+      if (memcmp(s + bit + 1, q + 1, qlen - 2) == 0)
+        return s + bit;
+      mask &= ~(0xfULL << (bit * 4));
+    }
+    s += 16;
+  }
+  return searchScalar(s, end, q, qlen);
+}
+#endif
+
+void searchInit() // picks the widest kernel this machine runs and starts the worker pool
+{
+  struct search_state *st = &E.search;
+  st->kernel = searchScalar;
+#if defined(__SSE2__)
+  st->kernel = searchSSE2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    st->kernel = searchAVX2;
+#endif
+#if defined(__ARM_NEON)
+  st->kernel = searchNEON;
+#endif
+  st->query = NULL;
+  st->qlen = 0;
+  st->regex = 0;
+  st->re = NULL;
+  st->regex_err = NULL;
+  memset(st->regexes, 0, sizeof(st->regexes));
+  st->regex_clock = 0;
+  st->chunks = NULL;
+  st->ready = NULL;
+  st->nchunks = 0;
+  st->chunkcap = 0;
+  st->next = 0;
+  st->ndone = 0;
+  st->nready = 0;
+  st->gen = 0;
+  st->busy = 0;
+  if (pipe(st->wake) == -1)
+    die("pipe");
+  fcntl(st->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(st->wake[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&st->lock, NULL);
+  pthread_cond_init(&st->work, NULL);
+  pthread_cond_init(&st->idle, NULL);
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  st->nworkers = ncpu < 1 ? 1 : (ncpu > LEXI_SEARCH_THREADS ? LEXI_SEARCH_THREADS : ncpu);
+  static int ids[LEXI_SEARCH_THREADS]; // each worker has its own DFAs
+  int i;
+  for (i = 0; i < st->nworkers; i++)
+  {
+    pthread_t tid;
+    ids[i] = i;
+    if (pthread_create(&tid, NULL, searchWorker, &ids[i]) != 0)
+      die("pthread_create");
+    pthread_detach(tid);
+  }
+}
+
+void searchAddMatch(struct search_chunk *chunk, long long row, long long col, long long len)
+{
+  if (chunk->nmatches == chunk->cap)
+  {
+    chunk->cap = chunk->cap ? chunk->cap * 2 : 64;
+    chunk->matches = realloc(chunk->matches, sizeof(struct search_match) * chunk->cap);
+    if (chunk->matches == NULL)
+      die("realloc");
+  }
+  chunk->matches[chunk->nmatches].row = row;
+  chunk->matches[chunk->nmatches].col = col;
+  chunk->matches[chunk->nmatches].len = len;
+  chunk->nmatches++;
+}
+
+void searchRegexText(struct search_chunk *chunk, int worker, const char *s, const char *end, long long row)
+{
+  // runs the compiled query over each line of a piece of text, with the
+  // line's trailing \r dropped like rows do
+  struct regex *re = E.search.re;
+  while (s < end)
+  {
+    const char *nl = memchr(s, '\n', end - s);
+    long long len = (nl ? nl : end) - s;
+    long long from = 0, start, stop;
+    while (len > 0 && s[len - 1] == '\r')
+      len--;
+    while (regexMatch(re, worker, s, len, from, &start, &stop))
+    {
+      searchAddMatch(chunk, row, start, stop - start);
+      from = stop;
+    }
+    if (nl == NULL)
+      break;
+    s = nl + 1;
+    row++;
+  }
+}
+
+void searchText(struct search_chunk *chunk, const char *s, const char *end, long long row)
+{
+  // records the matches in a piece of text starting at the beginning of `row`;
+  // the query holds no control characters, so no match crosses a line end
+  struct search_state *st = &E.search;
+  const char *line = s;
+  const char *counted = s; // newlines before this are in row already
+  const char *m;
+  while ((m = st->kernel(s, end, st->query, st->qlen)) != NULL)
+  {
+    const char *nl;
+    while ((nl = memchr(counted, '\n', m - counted)) != NULL)
+    {
+      line = counted = nl + 1;
+      row++;
+    }
+    counted = m;
+    searchAddMatch(chunk, row, m - line, st->qlen);
+    s = m + 1;
+  }
+}
+
+int searchChunk(struct search_chunk *chunk, unsigned gen, int worker) // returns 0 if the search was cancelled midway
+{
+  buffer_node *leaf = chunk->leaf;
+  long long row = chunk->row;
+  int i, j;
+  chunk->nmatches = 0;
+  for (i = 0; i < chunk->nleaves; i++)
+  {
+    if (i > 0) // never past the chunk's last leaf, whose next the loader may be setting
+      leaf = leaf->next;
+    if (__atomic_load_n(&E.search.gen, __ATOMIC_RELAXED) != gen)
+      return 0;
+    editor_row *rows = __atomic_load_n(&leaf->rows, __ATOMIC_ACQUIRE); // the main thread may load the leaf meanwhile
+    if (rows == NULL && E.search.re)
+    {
+      searchRegexText(chunk, worker, E.map + leaf->mapoff, E.map + leaf->mapend, row);
+    }
+    else if (rows == NULL)
+    {
+      searchText(chunk, E.map + leaf->mapoff, E.map + leaf->mapend, row);
+    }
+    else
+    {
+      for (j = 0; j < leaf->n; j++)
+      {
+        if (E.search.re)
+          searchRegexText(chunk, worker, rows[j].chars, rows[j].chars + rows[j].size, row + j);
+        else
+          searchText(chunk, rows[j].chars, rows[j].chars + rows[j].size, row + j);
+      }
+    }
+    row += leaf->n;
+  }
+  return 1;
+}
+
+void *searchWorker(void *arg)
+{
+  struct search_state *st = &E.search;
+  int worker = *(int *)arg;
+  pthread_mutex_lock(&st->lock);
+  while (1)
+  {
+    while (st->next >= st->nchunks)
+      pthread_cond_wait(&st->work, &st->lock);
+    int c = (st->origin + st->next++) % st->nchunks; // chunks are claimed from where the search started
+    unsigned gen = st->gen;
+    st->busy++;
+    pthread_mutex_unlock(&st->lock);
+    int finished = searchChunk(&st->chunks[c], gen, worker);
+    pthread_mutex_lock(&st->lock);
+    st->busy--;
+    if (finished && gen == st->gen)
+    {
+      st->chunks[c].done = 1;
+      st->ndone++;
+      if (write(st->wake[1], "", 1) == -1 && errno != EAGAIN)
+        die("write");
+    }
+    if (st->busy == 0)
+      pthread_cond_broadcast(&st->idle);
+  }
+  return NULL;
+}
+
+void searchCancel() // stops the running search and waits until no worker touches the buffer
+{
+  struct search_state *st = &E.search;
+  pthread_mutex_lock(&st->lock);
+  __atomic_store_n(&st->gen, st->gen + 1, __ATOMIC_RELAXED);
+  st->nchunks = 0;
+  st->next = 0;
+  st->ndone = 0;
+  while (st->busy > 0)
+    pthread_cond_wait(&st->idle, &st->lock);
+  pthread_mutex_unlock(&st->lock);
+  st->nready = 0;
+  char drain[64];
+  while (read(st->wake[0], drain, sizeof(drain)) > 0)
+    ;
+}
+
+int searchChunkOf(long long row) // chunk holding `row`
+{
+  struct search_state *st = &E.search;
+  int lo = 0, hi = st->nchunks - 1;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (st->chunks[mid].row <= row)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+void searchStart(const char *query, long long row, long long col)
+{
+  // splits the buffer into chunks of leaves and hands them to the workers,
+  // starting with the chunk holding (row, col) so the nearest match comes first
+  struct search_state *st = &E.search;
+  searchCancel();
+  free(st->query);
+  st->query = strdup(query);
+  st->qlen = strlen(query);
+  st->origin_row = row;
+  st->origin_col = col;
+  st->shown = 0;
+  st->partial = editorIndexing();
+  st->re = NULL;
+  st->regex_err = NULL;
+  if (st->qlen == 0 || E.numrows == 0)
     return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdaterow(row);
-  E.dirty++;
+  if (st->regex && strpbrk(query, "\\.[]()*+?{}|^$") != NULL) // plain text still goes to the literal kernels
+  {
+    st->re = regexGet(query, &st->regex_err);
+    if (st->re == NULL)
+      return;
+  }
+  int nchunks = 0;
+  long long first = 0;
+  int j;
+  buffer_node *leaf = bufLeafAt(0, &j);
+  while (leaf)
+  {
+    if (nchunks == st->chunkcap)
+    {
+      st->chunkcap = st->chunkcap ? st->chunkcap * 2 : 64;
+      st->chunks = realloc(st->chunks, sizeof(struct search_chunk) * st->chunkcap);
+      st->ready = realloc(st->ready, st->chunkcap);
+      if (st->chunks == NULL || st->ready == NULL)
+        die("realloc");
+      memset(&st->chunks[nchunks], 0, sizeof(struct search_chunk) * (st->chunkcap - nchunks));
+    }
+    struct search_chunk *chunk = &st->chunks[nchunks++];
+    chunk->leaf = leaf;
+    chunk->row = first;
+    chunk->nleaves = 0;
+    chunk->done = 0;
+    while (leaf && chunk->nleaves < LEXI_SEARCH_CHUNK)
+    {
+      first += leaf->n;
+      chunk->nleaves++;
+      leaf = leaf->next;
+    }
+  }
+  memset(st->ready, 0, nchunks);
+  pthread_mutex_lock(&st->lock);
+  st->nchunks = nchunks;
+  st->origin = searchChunkOf(row);
+  st->next = 0;
+  st->ndone = 0;
+  pthread_cond_broadcast(&st->work);
+  pthread_mutex_unlock(&st->lock);
 }
 
-void editorRowInsertChar(editor_row *row, int at, int c)
+int searchRunning()
 {
-  if (at < 0 || at > row->size)
-    at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdaterow(row);
-  E.dirty++;
+  return E.search.nready < E.search.nchunks;
 }
 
-void editorRowAppendString(editor_row *row, char *s, size_t len) // append string to the end of a row
+long long searchLocate(struct search_chunk *chunk, long long row, long long col) // index of the first match at or after (row, col)
 {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdaterow(row);
-  E.dirty++;
+  long long lo = 0, hi = chunk->nmatches;
+  while (lo < hi)
+  {
+    long long mid = lo + (hi - lo) / 2;
+    struct search_match *m = &chunk->matches[mid];
+    if (m->row < row || (m->row == row && m->col < col))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
 }
 
-/*** editor operations ***/
-void editorInsertChar(int c)
+long long searchStep(long long row, long long col, int dir, int complete, int *chunk)
 {
-  if (E.cursor_y == E.numrows)
+  // finds the first match at or after (row, col), or the last one before it
+  // when dir is -1, wrapping around the buffer; finished chunks are skipped
+  // over unless `complete` asks for an answer that later results cannot change
+  struct search_state *st = &E.search;
+  int n = st->nchunks;
+  int start = searchChunkOf(row);
+  int i;
+  for (i = 0; i <= n; i++)
   {
-    editorInsertRow(E.numrows, "", 0);
+    int c = (start + dir * i + n) % n;
+    if (!st->ready[c])
+    {
+      if (complete)
+        return -1;
+      continue;
+    }
+    struct search_chunk *ch = &st->chunks[c];
+    long long k;
+    if (i == 0)
+      k = searchLocate(ch, row, col) - (dir < 0);
+    else
+      k = dir > 0 ? 0 : ch->nmatches - 1;
+    if (k >= 0 && k < ch->nmatches)
+    {
+      *chunk = c;
+      return k;
+    }
   }
-  editorRowInsertChar(&E.row[E.cursor_y], E.cursor_x, c);
-  E.cursor_x++;
+  return -1;
 }
 
-void editorInsertNewline()
+void searchShow(int c, long long k)
 {
-  if (E.cursor_x == 0)
+  struct search_state *st = &E.search;
+  E.cursor_y = st->chunks[c].matches[k].row;
+  E.cursor_x = st->chunks[c].matches[k].col;
+  E.rowoff = E.numrows; // scroll so the match ends up at the top of the screen
+  st->shown = 1;
+}
+
+void searchUpdatePrompt()
+{
+  struct search_state *st = &E.search;
+  long long total = 0, before = 0, current = 0;
+  int c;
+  for (c = 0; c < st->nchunks; c++)
   {
-    editorInsertRow(E.cursor_y, "", 0);
+    if (!st->ready[c])
+      continue;
+    struct search_chunk *ch = &st->chunks[c];
+    long long k = searchLocate(ch, E.cursor_y, E.cursor_x);
+    if (k < ch->nmatches && ch->matches[k].row == E.cursor_y && ch->matches[k].col == E.cursor_x)
+      current = before + k + 1;
+    total += ch->nmatches;
+    before += ch->nmatches;
   }
+  const char *mode = st->replace ? (st->regex ? "Replace regex" : "Replace") : (st->regex ? "Regex" : "Search");
+  if (st->regex_err)
+    snprintf(st->prompt, sizeof(st->prompt), "%s: %%s (%s)", mode, st->regex_err);
+  else if (st->qlen == 0)
+    snprintf(st->prompt, sizeof(st->prompt), "%s: %%s (Use ESC/Arrows/Enter, Ctrl-R %s)", mode, st->regex ? "text" : "regex");
+  else if (searchRunning())
+    snprintf(st->prompt, sizeof(st->prompt), "%s: %%s (%lld matches so far, %d%%%% searched)", mode, total, st->nready * 100 / st->nchunks);
+  else if (total == 0)
+    snprintf(st->prompt, sizeof(st->prompt), "%s: %%s (no matches)", mode);
   else
+    snprintf(st->prompt, sizeof(st->prompt), "%s: %%s (match %lld of %lld, Use ESC/Arrows/Enter)", mode, current, total);
+}
+
+void searchCollect() // picks up the chunks the workers finished
+{
+  struct search_state *st = &E.search;
+  char drain[64];
+  int c;
+  while (read(st->wake[0], drain, sizeof(drain)) > 0)
+    ;
+  pthread_mutex_lock(&st->lock);
+  for (c = 0; c < st->nchunks; c++)
   {
-    editor_row *row = &E.row[E.cursor_y];
-    editorInsertRow(E.cursor_y + 1, &row->chars[E.cursor_x], row->size - E.cursor_x);
-    row = &E.row[E.cursor_y];
-    row->size = E.cursor_x;
-    row->chars[row->size] = '\0';
-    editorUpdaterow(row);
+    if (st->chunks[c].done && !st->ready[c])
+    {
+      st->ready[c] = 1;
+      st->nready++;
+    }
   }
-  E.cursor_y++;
-  E.cursor_x = 0;
+  pthread_mutex_unlock(&st->lock);
 }
 
-void editorDelChar()
+void searchFinish() // waits until every chunk has been searched
 {
-  if (E.cursor_y == E.numrows)
+  struct pollfd pfd = {E.search.wake[0], POLLIN, 0};
+  searchCollect();
+  while (searchRunning())
+  {
+    poll(&pfd, 1, -1);
+    searchCollect();
+  }
+}
+
+void searchPoll() // picks up chunks the workers finished and shows the nearest match once it is known
+{
+  struct search_state *st = &E.search;
+  int c;
+  long long k;
+  searchCollect();
+  if (!st->shown && (k = searchStep(st->origin_row, st->origin_col, 1, 1, &c)) >= 0)
+    searchShow(c, k);
+  searchUpdatePrompt();
+  editorSetStatusMessage(st->prompt, st->query);
+  editorRefreshScreen();
+}
+
+void editorFindCallback(char *query, int key) //callback function for editor prompt
+{
+  struct search_state *st = &E.search;
+  int c;
+  long long k;
+  if (key == '\r' || key == '\x1b')
+  {
+    searchCancel();
     return;
-  if (E.cursor_x == 0 && E.cursor_y == 0)
+  }
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) // arrow keys will go to the next match
+  {
+    if (st->nchunks && (k = searchStep(E.cursor_y, E.cursor_x + 1, 1, 0, &c)) >= 0)
+      searchShow(c, k);
+  }
+  else if (key == ARROW_LEFT || key == ARROW_UP) // arrow keys will go to the previous match
+  {
+    if (st->nchunks && (k = searchStep(E.cursor_y, E.cursor_x, -1, 0, &c)) >= 0)
+      searchShow(c, k);
+  }
+  else if (key == CTRL_KEY('r'))
+  {
+    st->regex = !st->regex;
+    searchStart(query, st->origin_row, st->origin_col);
+  }
+  else if (st->query == NULL || strcmp(query, st->query) != 0)
+  {
+    searchStart(query, st->origin_row, st->origin_col); // the query changed, the old search is cancelled
+  }
+  searchUpdatePrompt();
+}
+char *editorFindQuery(int replace) // asks for a query, searching as it is typed; NULL if ESC was pressed
+{
+  long long saved_cx = E.cursor_x; // saves the cursor position incase user clicks escape key
+  long long saved_cy = E.cursor_y;
+  long long saved_coloff = E.coloff; // saves the scroll position incase user clicks escape key
+  long long saved_rowoff = E.rowoff;
+  free(E.search.query);
+  E.search.query = NULL;
+  E.search.origin_row = saved_cy;
+  E.search.origin_col = saved_cx;
+  E.search.qlen = 0;
+  E.search.regex_err = NULL;
+  E.search.replace = replace;
+  searchUpdatePrompt();
+  char *query = editorPrompt(E.search.prompt, editorFindCallback, 0);
+  searchCancel();
+  E.search.replace = 0;
+  if (query == NULL)
+  {
+    E.cursor_x = saved_cx;
+    E.cursor_y = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+  return query;
+}
+
+void editorFind()
+{
+  free(editorFindQuery(0));
+}
+
+long long editorReplaceRow(long long y, struct search_match *m, long long n, const char *with, long long wlen,
+                           char **buf, long long *cap)
+{
+  // rewrites the part of row y from its first match to the end of its last
+  // in one splice, skipping matches that overlap the one before; the old and
+  // new text go to the undo log together. Returns how many were replaced,
+  // 0 if the row is left as it was
+  editor_row *row = editorRowAt(y);
+  long long from = m[0].col, end = from, matched = 0, count = 0;
+  long long i;
+  for (i = 0; i < n; i++)
+  {
+    if (m[i].col < end || m[i].col + m[i].len > row->size)
+      continue;
+    end = m[i].col + m[i].len;
+    matched += m[i].len;
+    count++;
+  }
+  long long was = end - from, now = was - matched + count * wlen;
+  if (was + now == 0) // empty matches replaced by nothing
+    return 0;
+  if (was + now > *cap)
+  {
+    *cap = (was + now) * 2;
+    free(*buf);
+    *buf = malloc(*cap);
+    if (*buf == NULL)
+      die("malloc");
+  }
+  char *out = *buf + was;
+  long long pos = from;
+  memcpy(*buf, &row->chars[from], was);
+  for (i = 0; i < n; i++)
+  {
+    if (m[i].col < pos || m[i].col + m[i].len > row->size)
+      continue;
+    memcpy(out, &row->chars[pos], m[i].col - pos);
+    out += m[i].col - pos;
+    memcpy(out, with, wlen);
+    out += wlen;
+    pos = m[i].col + m[i].len;
+  }
+  undoRecord(UNDO_REPLACE, y, from, y, from + now, *buf, was + now);
+  editorRowSplice(y, from, was, *buf + was, now);
+  return count;
+}
+
+void editorReplaceAll(const char *query, const char *with)
+{
+  // the workers find every match at once, then each row holding any is
+  // rebuilt with a single splice; the rows are changed by this thread alone
+  // since the tree is not safe to edit from several
+  struct search_state *st = &E.search;
+  long long start = statNow();
+  editorIndexAll();
+  searchStart(query, 0, 0);
+  if (st->regex_err)
+  {
+    editorSetStatusMessage("Bad pattern: %s", st->regex_err);
     return;
-  editor_row *row = &E.row[E.cursor_y];
-  if (E.cursor_x > 0)
+  }
+  searchFinish();
+  int nchunks = st->nchunks;
+  searchCancel(); // the results stay, but no worker is left reading the rows
+  long long wlen = strlen(with), count = 0, rows = 0, cap = 0;
+  char *buf = NULL;
+  undoBegin();
+  unsigned long long group = E.undo.group;
+  int c;
+  for (c = 0; c < nchunks; c++)
   {
-    editorRowDelChar(row, E.cursor_x - 1);
-    E.cursor_x--;
+    struct search_chunk *ch = &st->chunks[c];
+    long long k = 0;
+    while (k < ch->nmatches)
+    {
+      long long first = k;
+      while (k < ch->nmatches && ch->matches[k].row == ch->matches[first].row)
+        k++;
+      long long done = editorReplaceRow(ch->matches[first].row, &ch->matches[first], k - first, with, wlen, &buf, &cap);
+      count += done;
+      rows += done > 0;
+    }
   }
+  undoEnd();
+  free(buf);
+  long long kept = 0;
+  while (kept < E.undo.done && E.undo.entries[E.undo.done - 1 - kept].group == group)
+    kept++;
+  if (kept < rows) // the log trimmed the start of the replace, so none of it can be undone
+    E.undo.n = E.undo.done -= kept;
+  if (E.cursor_y < E.numrows && E.cursor_x > editorRowAt(E.cursor_y)->size)
+    E.cursor_x = editorRowAt(E.cursor_y)->size;
+  double ms = (statNow() - start) / 1e6;
+  if (count == 0)
+    editorSetStatusMessage("No matches for %s", query);
+  else if (kept == rows)
+    editorSetStatusMessage("Replaced %lld matches on %lld lines in %.1f ms", count, rows, ms);
   else
+    editorSetStatusMessage("Replaced %lld matches on %lld lines in %.1f ms, too many to undo", count, rows, ms);
+}
+
+void editorReplace() // replaces every match of a query, as a single edit
+{
+  long long saved_cx = E.cursor_x;
+  long long saved_cy = E.cursor_y;
+  long long saved_coloff = E.coloff;
+  long long saved_rowoff = E.rowoff;
+  char *query = editorFindQuery(1);
+  if (query == NULL)
+    return;
+  E.cursor_x = saved_cx; // back where it was, not on the match the prompt showed
+  E.cursor_y = saved_cy;
+  E.coloff = saved_coloff;
+  E.rowoff = saved_rowoff;
+  char prompt[96];
+  int n = snprintf(prompt, sizeof(prompt), "Replace ");
+  const char *q;
+  for (q = query; *q && n < 48; q++) // the query goes through the format, so its % signs are doubled
   {
-    E.cursor_x = E.row[E.cursor_y - 1].size;
-    editorRowAppendString(&E.row[E.cursor_y - 1], row->chars, row->size);
-    editorDelRow(E.cursor_y);
-    E.cursor_y--;
+    if (*q == '%')
+      prompt[n++] = '%';
+    prompt[n++] = *q;
   }
+  snprintf(prompt + n, sizeof(prompt) - n, " with: %%s (ESC to cancel)");
+  char *with = editorPrompt(prompt, NULL, 1);
+  if (with)
+    editorReplaceAll(query, with);
+  free(with);
+  free(query);
 }
-/*** file i/o ***/
+/*** append buffer ***/
 
-char *editorRowsToString(int *buflen) // write the erow structures from array to a file by converting them into a single string
+// A frame is written with one writev. Escape sequences and short runs of
+// text are copied into the buffer, while longer runs are referenced where
+// they lie in the frame, which stays untouched until the write is done. The
+// buffer and its iovecs are sized from the screen and kept across frames,
+// so drawing one does not allocate.
+
+void abInit(struct append_buffer *ab, int cap, int iovcap)
 {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++)
-  {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+  ab->b = malloc(cap);
+  ab->iov = malloc(iovcap * sizeof(struct iovec));
+  if (ab->b == NULL || ab->iov == NULL)
+    die("malloc");
+  ab->cap = cap;
+  ab->iovcap = iovcap;
+  ab->len = ab->niov = ab->mark = ab->total = 0;
+}
+
+void abReset(struct append_buffer *ab) // empties the buffer, keeping its memory
+{
+  ab->len = ab->niov = ab->mark = ab->total = 0;
+}
+
+void abAppend(struct append_buffer *ab, const char *s, int len)
+{
+  if (ab->len + len > ab->cap)
+  {
+    int cap = ab->cap ? ab->cap * 2 : 4096; // grow geometrically, the size is kept for the next frames
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+      return;
+    E.alloc.calls[ALLOC_FRAME]++;
+    ab->b = new;
+    ab->cap = cap;
   }
-  return buf;
+  memcpy(&ab->b[ab->len], s, len); // memcpy() comes from <string.h>, and copies the string s at the end of the current data in the buffer
+  ab->len += len;
+  ab->total += len;
 }
 
-void editorOpen(char *filename)
+void abPiece(struct append_buffer *ab, const char *s, int len) // adds an iovec, s is NULL for the next bytes of b
 {
-  // allows the user to open a file
-  free(E.filename);
-  E.filename = strdup(filename);
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  if (ab->niov == ab->iovcap)
   {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+    ab->iovcap *= 2;
+    ab->iov = realloc(ab->iov, ab->iovcap * sizeof(struct iovec));
+    if (ab->iov == NULL)
+      die("realloc");
+    E.alloc.calls[ALLOC_FRAME]++;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  ab->iov[ab->niov].iov_base = (char *)s;
+  ab->iov[ab->niov].iov_len = len;
+  ab->niov++;
 }
 
-void editorSave() // save the file to the disk
+void abCut(struct append_buffer *ab) // closes the bytes copied since the last piece into one
+{
+  if (ab->len > ab->mark)
+    abPiece(ab, NULL, ab->len - ab->mark);
+  ab->mark = ab->len;
+}
+
+void abRef(struct append_buffer *ab, const char *s, int len) // appends text that stays put until abWrite
 {
-  if (E.filename == NULL)
+  if (len < LEXI_IOV_MIN)
   {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL)
+    abAppend(ab, s, len);
+    return;
+  }
+  abCut(ab);
+  abPiece(ab, s, len);
+  ab->total += len;
+}
+
+int abWrite(struct append_buffer *ab, int fd) // writes the pieces out and empties the buffer, -1 on an error
+{
+  int i, off = 0;
+  abCut(ab);
+  for (i = 0; i < ab->niov; i++) // b is not moved any more, point the copied runs into it
+  {
+    if (ab->iov[i].iov_base == NULL)
     {
-      editorSetStatusMessage("Save aborted");
-      return;
+      ab->iov[i].iov_base = ab->b + off;
+      off += ab->iov[i].iov_len;
     }
   }
-  int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644); // O_CREAT : Create if it doesn't exist, O_RDWR : Read and write
-  if (fd != -1)
+  struct iovec *iov = ab->iov;
+  int n = ab->niov;
+  while (n > 0)
   {
-    if (ftruncate(fd, len) != -1)
+    ssize_t w = writev(fd, iov, n < LEXI_IOV_BATCH ? n : LEXI_IOV_BATCH);
+    if (w == -1)
     {
-      if (write(fd, buf, len) == len)
-      {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+      if (errno == EINTR)
+        continue;
+      abReset(ab);
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) // skip what went out, resume inside a partial iovec
+    {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
     }
-    close(fd);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  abReset(ab);
+  return 0;
 }
-/*** find ***/
-void editorFindCallback(char *query, int key) //callback function for editor prompt
+
+/*** screen frame ***/
+
+// The screen is composed into a grid of cells and compared with a shadow copy
+// of what the terminal already shows, so each frame only emits the cells that
+// changed, jumping the cursor over the spans that did not.
+
+void frameAlloc(struct screen_frame *f, int rows, int cols)
+{
+  f->rows = rows;
+  f->cols = cols;
+  f->chars = malloc(rows * cols);
+  f->attrs = malloc(rows * cols);
+  if (f->chars == NULL || f->attrs == NULL)
+    die("malloc");
+}
+
+void frameClear(struct screen_frame *f)
+{
+  memset(f->chars, ' ', f->rows * f->cols);
+  memset(f->attrs, ATTR_NORMAL, f->rows * f->cols);
+}
+
+void frameWrite(int y, int x, const char *s, int len, unsigned char attr) // puts text into the frame being built, clipped to the row
+{
+  struct screen_frame *f = &E.frame;
+  if (y < 0 || y >= f->rows || x >= f->cols)
+    return;
+  if (len > f->cols - x)
+    len = f->cols - x;
+  if (len <= 0)
+    return;
+  memcpy(&f->chars[y * f->cols + x], s, len);
+  memset(&f->attrs[y * f->cols + x], attr, len);
+}
+
+void frameWriteColored(int y, int x, const char *s, const unsigned char *attrs, int len) // like frameWrite with an attribute per cell
+{
+  struct screen_frame *f = &E.frame;
+  if (y < 0 || y >= f->rows || x >= f->cols)
+    return;
+  if (len > f->cols - x)
+    len = f->cols - x;
+  if (len <= 0)
+    return;
+  memcpy(&f->chars[y * f->cols + x], s, len);
+  memcpy(&f->attrs[y * f->cols + x], attrs, len);
+}
+
+void frameFill(int y, int x, int len, char c, unsigned char attr)
 {
-  static int last_match = -1;
-  static int direction = 1;
-  if (key == '\r' || key == '\x1b')
-  {
-    last_match = -1;
-    direction = 1; // setting direction to 1 makes user always search in the forward direction
+  struct screen_frame *f = &E.frame;
+  if (y < 0 || y >= f->rows || x >= f->cols)
     return;
-  }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN) // arrow keys will go to the next match
-  {
-    direction = 1;
-  }
-  else if (key == ARROW_LEFT || key == ARROW_UP) // arrow keys will go to the previous match
+  if (len > f->cols - x)
+    len = f->cols - x;
+  if (len <= 0)
+    return;
+  memset(&f->chars[y * f->cols + x], c, len);
+  memset(&f->attrs[y * f->cols + x], attr, len);
+}
+
+void frameSetAttr(struct append_buffer *ab, unsigned char attr)
+{
+  switch (attr)
   {
-    direction = -1;
+  case ATTR_INVERSE:
+    abAppend(ab, "\x1b[0;7m", 6);
+    break;
+  case ATTR_COMMENT:
+    abAppend(ab, "\x1b[0;36m", 7);
+    break;
+  case ATTR_KEYWORD1:
+    abAppend(ab, "\x1b[0;33m", 7);
+    break;
+  case ATTR_KEYWORD2:
+    abAppend(ab, "\x1b[0;32m", 7);
+    break;
+  case ATTR_STRING:
+    abAppend(ab, "\x1b[0;35m", 7);
+    break;
+  case ATTR_NUMBER:
+    abAppend(ab, "\x1b[0;31m", 7);
+    break;
+  default:
+    abAppend(ab, "\x1b[m", 3);
+    break;
   }
+}
+
+void frameMoveTo(struct append_buffer *ab, int y, int x) // shortest way to move the terminal cursor to (y, x)
+{
+  char buf[32];
+  int len;
+  if (y == E.term_cy && x == E.term_cx)
+    return;
+  if (y == E.term_cy && x > E.term_cx)
+    len = snprintf(buf, sizeof(buf), "\x1b[%dC", x - E.term_cx);
   else
-  {
-    last_match = -1;
-    direction = 1;
-  }
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++)
-  {
-    current += direction;
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-    editor_row *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match)
-    {
-      last_match = current; // once match is found we set last match to current so if the user presses the arrow keys, we will start the next search from there
-      E.cursor_y = current; // current is index of current row the user is searching
-      E.cursor_x = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-      break;
-    }
-  }
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+  E.term_cy = y;
+  E.term_cx = x;
 }
-void editorFind()
+
+void frameScroll(struct append_buffer *ab, int n)
 {
-  int saved_cx = E.cursor_x; // saves the cursor position incase user clicks escape key
-  int saved_cy = E.cursor_y;
-  int saved_coloff = E.coloff; // saves the scroll position incase user clicks escape key
-  int saved_rowoff = E.rowoff;
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-  if (query)
+  // moves the text area up (n > 0) or down by n lines with a scroll region
+  // that leaves the bars alone, and shifts the shadow frame to match so that
+  // only the rows scrolled into view differ from it
+  struct screen_frame *s = &E.shadow;
+  int rows = E.screenrows;
+  int cols = s->cols;
+  int k = n > 0 ? n : -n;
+  char buf[48];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, k, n > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+  E.term_cx = E.term_cy = -1; // setting the scroll region homes the cursor
+  if (n > 0)
   {
-    free(query);
+    memmove(s->chars, &s->chars[k * cols], (rows - k) * cols);
+    memmove(s->attrs, &s->attrs[k * cols], (rows - k) * cols);
+    memset(&s->chars[(rows - k) * cols], ' ', k * cols);
+    memset(&s->attrs[(rows - k) * cols], ATTR_NORMAL, k * cols);
   }
   else
   {
-    E.cursor_x = saved_cx;
-    E.cursor_y = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    memmove(&s->chars[k * cols], s->chars, (rows - k) * cols);
+    memmove(&s->attrs[k * cols], s->attrs, (rows - k) * cols);
+    memset(s->chars, ' ', k * cols);
+    memset(s->attrs, ATTR_NORMAL, k * cols);
   }
 }
-/*** append buffer ***/
-
-struct append_buffer
-{ // acts as a dynamic string
-  char *b;
-  int len;
-};
-#define append_buffer_INIT \
-  {                        \
-    NULL, 0                \
-  } // acts as an empty buffer
 
-void abAppend(struct append_buffer *ab, const char *s, int len)
+int frameRowPlain(const char *s, int len) // no byte of a UTF-8 sequence, so each cell is one terminal column
 {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL)
-    return;
-  memcpy(&new[ab->len], s, len); // memcpy() comes from <string.h>, and copies the string s at the end of the current data in the buffer
-  ab->b = new;
-  ab->len += len;
+  int i;
+  for (i = 0; i < len; i++)
+    if ((unsigned char)s[i] >= 0x80)
+      return 0;
+  return 1;
 }
-void abFree(struct append_buffer *ab)
-{ // de-allocates memory used by append_buffer
-  free(ab->b);
+
+void frameFlush(struct append_buffer *ab) // appends what it takes to turn the shadow frame into the new one
+{
+  struct screen_frame *f = &E.frame;
+  struct screen_frame *s = &E.shadow;
+  unsigned char attr = ATTR_NORMAL;
+  int y;
+  if (!E.shadow_valid)
+  {
+    abAppend(ab, "\x1b[m\x1b[2J", 7); // start from a blank screen and diff against that
+    frameClear(s);
+    E.term_cx = E.term_cy = -1;
+    E.shadow_valid = 1;
+  }
+  for (y = 0; y < f->rows; y++)
+  {
+    char *nc = &f->chars[y * f->cols], *oc = &s->chars[y * f->cols];
+    unsigned char *na = &f->attrs[y * f->cols], *oa = &s->attrs[y * f->cols];
+    int blank = f->cols; // cells from here on are plain spaces and can be erased with \x1b[K
+    while (blank > 0 && nc[blank - 1] == ' ' && na[blank - 1] == ATTR_NORMAL)
+      blank--;
+    int x = 0, plain = -1; // known at the first change
+    while (x < f->cols)
+    {
+      if (nc[x] == oc[x] && na[x] == oa[x])
+      {
+        x++;
+        continue;
+      }
+      int end = x + 1; // one past the last changed cell of this span
+      int k;
+      if (plain < 0)
+        plain = frameRowPlain(nc, f->cols) && frameRowPlain(oc, f->cols);
+      if (!plain) // cells are not columns on the terminal, so the row is drawn again from its start
+      {
+        x = 0;
+        end = f->cols;
+      }
+      for (k = end; k < f->cols && k - end < LEXI_DIFF_GAP; k++)
+        if (nc[k] != oc[k] || na[k] != oa[k])
+          end = k + 1;
+      frameMoveTo(ab, y, x);
+      int stop = end < blank ? end : (x > blank ? x : blank);
+      for (k = x; k < stop;)
+      {
+        int run = k + 1; // cells drawn with the same attribute go out as one piece
+        if (na[k] != attr)
+          frameSetAttr(ab, attr = na[k]);
+        while (run < stop && na[run] == attr)
+          run++;
+        abRef(ab, &nc[k], run - k);
+        k = run;
+      }
+      E.term_cx = stop;
+      if (!plain)
+        E.term_cx = E.term_cy = -1; // the terminal cursor is somewhere before cell stop
+      if (end > blank)
+      {
+        if (attr != ATTR_NORMAL)
+          frameSetAttr(ab, attr = ATTR_NORMAL);
+        abAppend(ab, "\x1b[K", 3);
+        break;
+      }
+      x = end;
+    }
+    if (E.term_cx >= f->cols)
+      E.term_cx = E.term_cy = -1; // writing the last column leaves the cursor in a terminal specific state
+  }
+  if (attr != ATTR_NORMAL)
+    frameSetAttr(ab, ATTR_NORMAL);
+  struct screen_frame tmp = E.shadow; // what was just drawn becomes the shadow of the next frame
+  E.shadow = E.frame;
+  E.frame = tmp;
 }
 
 /*** output ***/
@@ -573,7 +5594,7 @@ void editorScroll()
   E.rx = 0;
   if (E.cursor_y < E.numrows)
   {
-    E.rx = editorRowCxToRx(&E.row[E.cursor_y], E.cursor_x);
+    E.rx = editorRowCxToRx(editorRowAt(E.cursor_y), E.cursor_x);
   }
   if (E.cursor_y < E.rowoff)
   {
@@ -593,12 +5614,12 @@ void editorScroll()
   }
 }
 
-void editorDrawRows(struct append_buffer *ab)
+void editorDrawRows()
 { // handles drawing each row or column of text being edited
   int y;
   for (y = 0; y < E.screenrows; y++)
   {
-    int filerow = y + E.rowoff;
+    long long filerow = y + E.rowoff;
     if (filerow >= E.numrows)
     {
       if (E.numrows == 0 && y == E.screenrows / 3) // welcome message only displays if the text buffer is completely empty
@@ -609,90 +5630,138 @@ void editorDrawRows(struct append_buffer *ab)
           welcomelen = E.screencols;
         int padding = (E.screencols - welcomelen) / 2; // center the text
         if (padding)
-        {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+          frameWrite(y, 0, "~", 1, ATTR_NORMAL);
+        frameWrite(y, padding, welcome, welcomelen, ATTR_NORMAL);
       }
       else
       {
-        abAppend(ab, "~", 1);
+        frameWrite(y, 0, "~", 1, ATTR_NORMAL);
       }
     }
     else
     {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
+      editor_row *row = editorRowAt(filerow);
+      long long rsize;
+      if (row->size >= LEXI_LONG_ROW) // only the visible columns are expanded
+      {
+        char *window = editorRowWindow(row, E.coloff, E.screencols, &rsize);
+        if (rsize > 0)
+          frameWrite(y, 0, window, rsize, ATTR_NORMAL);
+        continue;
+      }
+      char *render = editorRowRender(row, &rsize);
+      unsigned char *hl = editorRowHighlight(filerow, row);
+      long long len = rsize - E.coloff;
       if (len > E.screencols)
         len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
+      if (len > 0 && hl)
+        frameWriteColored(y, 0, &render[E.coloff], &hl[E.coloff], len);
+      else if (len > 0)
+        frameWrite(y, 0, &render[E.coloff], len, ATTR_NORMAL);
     }
-    abAppend(ab, "\x1b[K", 3); // erases line one at a time
-
-    // last line handled separately
-    abAppend(ab, "\r\n", 2);
   }
 }
 
 // creating a status bar to display details about the file
-void editorDrawStatusBar(struct append_buffer *ab)
-{
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-                      E.cursor_y + 1, E.numrows);
+void editorDrawStatusBar()
+{
+  char status[80], rstatus[80], loading[24] = "";
+  if (editorIndexing() && E.load.total > 0)
+    snprintf(loading, sizeof(loading), "(loading %lld%%) ", E.load.loaded * 100 / E.load.total);
+  else if (editorIndexing())
+    snprintf(loading, sizeof(loading), "(loading) ");
+  int len = snprintf(status, sizeof(status), "%.20s - %lld%s lines %s%s%s",
+                     E.filename ? E.filename : "[No Name]", E.numrows, editorIndexing() ? "+" : "",
+                     loading, E.dirty ? "(modified) " : "", E.follow.on ? "[following]" : E.readonly ? "[read only]" : "");
+  long long total = E.buf->nbytes + (E.maplen - E.mapindexed); // the unindexed tail counts as it is on disk
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%lld/%lld %3lld%%",
+                      E.cursor_y + 1, E.numrows, total ? bufByteOfRow(E.cursor_y) * 100 / total : 100);
   if (len > E.screencols)
     len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols)
+  frameFill(E.screenrows, 0, E.screencols, ' ', ATTR_INVERSE);
+  frameWrite(E.screenrows, 0, status, len, ATTR_INVERSE);
+  if (len + rlen <= E.screencols)
+    frameWrite(E.screenrows, E.screencols - rlen, rstatus, rlen, ATTR_INVERSE);
+}
+
+void editorDrawStats() // p50/p99 of each stage in us, in place of the message bar
+{
+  static const char *names[STAT_BYTES] = {"in", "ed", "sc", "dr", "df", "wr", "fr"};
+  char buf[160];
+  int len = 0, s;
+  for (s = 0; s < STAT_BYTES; s++)
   {
-    if (E.screencols - len == rlen)
-    {
-      abAppend(ab, rstatus, rlen);
-      break;
-    }
-    else
-    {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+    len += snprintf(buf + len, sizeof(buf) - len, "%s %llu/%llu ", names[s],
+                    statPercentile(s, 0.5) / 1000, statPercentile(s, 0.99) / 1000);
+    if (len >= (int)sizeof(buf)) // snprintf returns what it would have written
+      len = sizeof(buf) - 1;
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  len += snprintf(buf + len, sizeof(buf) - len, "us %lluB/f", statPercentile(STAT_BYTES, 0.5));
+  if (len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+  frameWrite(E.screenrows + 1, 0, buf, len < E.screencols ? len : E.screencols, ATTR_NORMAL);
 }
 
-void editorDrawMessageBar(struct append_buffer *ab)
+void editorDrawMessageBar()
 {
-  abAppend(ab, "\x1b[K", 3);
+  if (E.stats_overlay)
+  {
+    editorDrawStats();
+    return;
+  }
   int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols)
-    msglen = E.screencols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+    frameWrite(E.screenrows + 1, 0, E.statusmsg, msglen, ATTR_NORMAL);
 }
 
 void editorRefreshScreen()
 {
+  long long frame = statBegin();
+  long long start = frame;
   editorScroll();
-  struct append_buffer ab = append_buffer_INIT;
-  abAppend(&ab, "\x1b[?25l", 6); // hide cursor
-  abAppend(&ab, "\x1b[H", 3);
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursor_y - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
-  abAppend(&ab, "\x1b[?25h", 6);      // show cursor
-  write(STDOUT_FILENO, ab.b, ab.len); // write() and STDOUT_FILENO come from <unistd.h>
-  abFree(&ab);
+  statEnd(STAT_SCROLL, start);
+  start = statBegin();
+  frameClear(&E.frame);
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+  statEnd(STAT_DRAW, start);
+  start = statBegin();
+  struct append_buffer *ab = &E.out;
+  if (E.sync_output)
+    abAppend(ab, "\x1b[?2026h", 8); // have the terminal show the frame at once
+  abAppend(ab, "\x1b[?25l", 6); // hide cursor
+  int header = ab->total;
+  long long delta = E.rowoff - E.shadow_rowoff;
+  if (E.shadow_valid && delta != 0 && E.coloff == E.shadow_coloff &&
+      delta * LEXI_SCROLL_MAX <= E.screenrows && -delta * LEXI_SCROLL_MAX <= E.screenrows)
+    frameScroll(ab, delta);
+  frameFlush(ab);
+  E.shadow_rowoff = E.rowoff;
+  E.shadow_coloff = E.coloff;
+  int changed = ab->total > header;
+  if (!changed)
+    abReset(ab); // at most the cursor moves, no need to hide it
+  frameMoveTo(ab, E.cursor_y - E.rowoff, E.rx - E.coloff);
+  if (changed)
+  {
+    abAppend(ab, "\x1b[?25h", 6); // show cursor
+    if (E.sync_output)
+      abAppend(ab, "\x1b[?2026l", 8);
+  }
+  statEnd(STAT_DIFF, start);
+  start = statBegin();
+  int bytes = ab->total;
+  abWrite(ab, STDOUT_FILENO); // the text runs are read from the frame, now the shadow, which is left alone until then
+  statEnd(STAT_WRITE, start);
+  statEnd(STAT_FRAME, frame);
+  if (frame)
+    statAdd(STAT_BYTES, bytes);
+  E.frame_bytes = bytes;
+  E.frame_time = editorNow();
+  E.redraw = 0;
+  E.alloc.ops[ALLOC_FRAME]++;
+  E.total_bytes += bytes;
 }
 
 // displaying messages to the user using a status message
@@ -707,7 +5776,7 @@ void editorSetStatusMessage(const char *fmt, ...)
 
 /*** input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int empty_ok) // empty_ok lets Enter take an empty answer
 {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
@@ -715,9 +5784,11 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
   buf[0] = '\0';
   while (1)
   {
+    statEnd(STAT_EDIT, E.edit_start); // time spent waiting in the prompt is not editing
     editorSetStatusMessage(prompt, buf);
     editorRefreshScreen();
     int c = editorReadKey();
+    E.edit_start = statBegin();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
     {
       if (buflen != 0)
@@ -733,7 +5804,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
     }
     else if (c == '\r')
     {
-      if (buflen != 0)
+      if (buflen != 0 || empty_ok)
       {
         editorSetStatusMessage("");
         if (callback)
@@ -756,9 +5827,63 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
   }
 }
 
+long long editorLastCursorY() // the line past the end only exists once the whole file is indexed
+{
+  return editorIndexing() ? E.numrows - 1 : E.numrows;
+}
+
+void editorGoto() // jumps to a line, a byte offset (@n) or a percentage of the file (n%)
+{
+  char *target = editorPrompt("Go to: %s (line, @byte or percent%%, ESC to cancel)", NULL, 0);
+  if (target == NULL)
+    return;
+  char *end;
+  long long n = strtoll(target[0] == '@' ? target + 1 : target, &end, 10);
+  int percent = *end == '%';
+  if (n < 0 || (*end != '\0' && !(percent && end[1] == '\0')))
+  {
+    editorSetStatusMessage("Not a line, @byte or percentage: %s", target);
+    free(target);
+    return;
+  }
+  if (target[0] != '@' && !percent) // line numbers count from 1
+  {
+    while (editorIndexing() && E.numrows < n && editorIndexWait())
+      ;
+    E.cursor_y = n > 0 ? n - 1 : 0;
+    if (E.cursor_y > editorLastCursorY())
+      E.cursor_y = editorLastCursorY();
+    E.cursor_x = 0;
+  }
+  else
+  {
+    if (percent)
+    {
+      editorIndexAll(); // the percentage is of the whole file
+      n = E.buf->nbytes * (n > 100 ? 100 : n) / 100;
+    }
+    while (editorIndexing() && E.buf->nbytes <= n && editorIndexWait())
+      ;
+    if (E.numrows == 0)
+    {
+      E.cursor_y = E.cursor_x = 0;
+    }
+    else
+    {
+      long long start;
+      E.cursor_y = bufRowOfByte(n, &start);
+      E.cursor_x = n - start;
+      if (E.cursor_x > editorRowAt(E.cursor_y)->size)
+        E.cursor_x = editorRowAt(E.cursor_y)->size;
+    }
+  }
+  E.rowoff = E.cursor_y - E.screenrows / 2 > 0 ? E.cursor_y - E.screenrows / 2 : 0; // show the target mid screen
+  free(target);
+}
+
 void editorMoveCursor(int key)
 {
-  editor_row *row = (E.cursor_y >= E.numrows) ? NULL : &E.row[E.cursor_y];
+  editor_row *row = (E.cursor_y >= E.numrows) ? NULL : editorRowAt(E.cursor_y);
   switch (key)
   {
   case ARROW_LEFT:
@@ -769,7 +5894,7 @@ void editorMoveCursor(int key)
     else if (E.cursor_y > 0)
     {
       E.cursor_y--;
-      E.cursor_x = E.row[E.cursor_y].size;
+      E.cursor_x = editorRowAt(E.cursor_y)->size;
     }
     break;
   case ARROW_RIGHT:
@@ -790,24 +5915,66 @@ void editorMoveCursor(int key)
     }
     break;
   case ARROW_DOWN:
-    if (E.cursor_y < E.numrows)
+    if (E.cursor_y + 1 >= E.numrows && editorIndexing())
+      editorIndexWait();
+    if (E.cursor_y < editorLastCursorY())
     {
       E.cursor_y++;
     }
     break;
   }
   // snapping cursor to the end of line
-  row = (E.cursor_y >= E.numrows) ? NULL : &E.row[E.cursor_y];
-  int rowlen = row ? row->size : 0;
+  row = (E.cursor_y >= E.numrows) ? NULL : editorRowAt(E.cursor_y);
+  long long rowlen = row ? row->size : 0;
   if (E.cursor_x > rowlen)
   {
     E.cursor_x = rowlen;
   }
 }
-void editorProcessKeypress() // to wait for a keypress and handles it
+int editorPagerKey(int c) // what a key does in a read only buffer, -1 for keys that would edit
+{
+  switch (c)
+  {
+  case 'q':
+    return CTRL_KEY('e');
+  case ' ':
+    return PAGE_DOWN;
+  case 'b':
+    return PAGE_UP;
+  case '/':
+    return CTRL_KEY('f');
+  case CTRL_KEY('e'):
+  case CTRL_KEY('s'):
+  case CTRL_KEY('f'):
+  case CTRL_KEY('g'):
+  case CTRL_KEY('t'):
+  case CTRL_KEY('p'):
+  case CTRL_KEY('l'):
+  case HOME_KEY:
+  case END_KEY:
+  case PAGE_UP:
+  case PAGE_DOWN:
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case '\x1b':
+    return c;
+  }
+  return -1;
+}
+
+void editorHandleKey(int c)
 {
   static int quit_times = LEXI_QUIT_TIMES;
-  int c = editorReadKey(); // to wait for one keypress and return it
+  int key = c;
+  if (E.readonly && (c = editorPagerKey(c)) == -1)
+  {
+    if (key == PASTE_START)
+      editorPaste(1); // read the pasted bytes so none of them run as commands
+    editorSetStatusMessage("Read only: q = quit | Space/b = page | / = find | Ctrl-S = save a copy");
+    return;
+  }
   switch (c)
   {
   case '\r':
@@ -822,6 +5989,7 @@ void editorProcessKeypress() // to wait for a keypress and handles it
       quit_times--;
       return;
     }
+    journalClose(1);
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
     exit(0);
@@ -831,16 +5999,43 @@ void editorProcessKeypress() // to wait for a keypress and handles it
     editorSave();
     break;
 
+  case CTRL_KEY('z'):
+    editorUndo();
+    break;
+  case CTRL_KEY('y'):
+    editorRedo();
+    break;
+
   case HOME_KEY:
     E.cursor_x = 0;
     break;
   case END_KEY: // moves the cursor to the end of the current line
     if (E.cursor_y < E.numrows)
-      E.cursor_x = E.row[E.cursor_y].size;
+      E.cursor_x = editorRowAt(E.cursor_y)->size;
     break;
   case CTRL_KEY('f'):
     editorFind();
     break;
+  case CTRL_KEY('r'):
+    editorReplace();
+    break;
+  case CTRL_KEY('g'):
+    editorGoto();
+    break;
+  case CTRL_KEY('t'): // follow the file as it grows, like tail -f
+    if (E.follow.on)
+    {
+      followStop();
+      editorSetStatusMessage("Stopped following %s", E.filename);
+    }
+    else
+    {
+      followStart();
+    }
+    break;
+  case PASTE_START:
+    editorPaste(0);
+    break;
   case BACKSPACE:
   case CTRL_KEY('h'):
   case DEL_KEY:
@@ -858,8 +6053,8 @@ void editorProcessKeypress() // to wait for a keypress and handles it
     else if (c == PAGE_DOWN)
     {
       E.cursor_y = E.rowoff + E.screenrows - 1;
-      if (E.cursor_y > E.numrows)
-        E.cursor_y = E.numrows;
+      if (E.cursor_y > editorLastCursorY())
+        E.cursor_y = editorLastCursorY();
     }
     int times = E.screenrows;
     while (times--)
@@ -873,7 +6068,12 @@ void editorProcessKeypress() // to wait for a keypress and handles it
   case ARROW_RIGHT:
     editorMoveCursor(c);
     break;
+  case CTRL_KEY('p'):
+    E.stats_overlay = !E.stats_overlay;
+    break;
   case CTRL_KEY('l'):
+    E.shadow_valid = 0; // repaint the whole screen in case something else drew on it
+    break;
   case '\x1b':
     break;
 
@@ -883,6 +6083,31 @@ void editorProcessKeypress() // to wait for a keypress and handles it
   }
 }
 
+void editorProcessKeypress() // to wait for a keypress and handles it
+{
+  int c = editorReadKey(); // to wait for one keypress and return it
+  E.edit_start = statBegin();
+  editorHandleKey(c);
+  statEnd(STAT_EDIT, E.edit_start);
+}
+
+void editorProcessPending() // applies the keys that arrive before the next frame is due, so they share one frame
+{
+  long long due = E.frame_time + LEXI_FRAME_MS;
+  long long limit = editorNow() + LEXI_FRAME_MS; // a flood of input still gets a frame this often
+  if (limit < due)
+    limit = due;
+  while (1)
+  {
+    long long now = editorNow();
+    if (now >= limit)
+      break;
+    if (!editorInputPending() && (now >= due || !editorWaitInput(due - now)))
+      break;
+    editorProcessKeypress();
+  }
+}
+
 /*** init ***/
 
 void initEditor()
@@ -893,43 +6118,427 @@ void initEditor()
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL; // initializing pointer to null
+  E.buf = bufNewNode(1); // an empty buffer is a single empty leaf
+  E.rcache_size = LEXI_RENDER_CACHE;
+  E.rcache = calloc(E.rcache_size, sizeof(struct render_slot));
+  if (E.rcache == NULL)
+    die("calloc");
+  E.rcache_hand = 0;
+  E.window = NULL;
+  E.window_cap = 0;
+  searchInit();
+  E.syntax = NULL;
+  E.map = NULL;
+  E.maplen = 0;
+  E.mapindexed = 0;
+  memset(&E.store, 0, sizeof(E.store));
+  memset(&E.alloc, 0, sizeof(E.alloc));
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
+  E.input = NULL;
+  E.inputlen = 0;
+  E.inputpos = 0;
+  memset(&E.load, 0, sizeof(E.load));
+  if (pipe(E.load.wake) == -1)
+    die("pipe");
+  fcntl(E.load.wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.load.wake[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&E.load.lock, NULL);
+  pthread_cond_init(&E.load.cond, NULL);
+  memset(&E.follow, 0, sizeof(E.follow));
+  E.follow.fd = E.follow.ifd = -1;
+  memset(&E.undo, 0, sizeof(E.undo));
+  memset(&E.journal, 0, sizeof(E.journal));
+  E.journal.fd = -1;
+  pthread_mutex_init(&E.journal.lock, NULL);
+  pthread_cond_init(&E.journal.cond, NULL);
+  E.undo.limit = getenv("LEXI_UNDO_MB") ? atoll(getenv("LEXI_UNDO_MB")) * 1024 * 1024 : LEXI_UNDO_LIMIT;
+  E.redraw = 0;
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
   E.screenrows -= 2;
+  frameAlloc(&E.frame, E.screenrows + 2, E.screencols); // text rows plus the status and message bars
+  frameAlloc(&E.shadow, E.screenrows + 2, E.screencols);
+  abInit(&E.out, (E.screenrows + 2) * E.screencols * 4, (E.screenrows + 2) * 4); // room for a repaint with a color change every few cells
+  E.shadow_valid = 0;
+  E.shadow_rowoff = 0;
+  E.shadow_coloff = 0;
+  E.term_cx = E.term_cy = -1;
+  E.sync_output = getSyncOutputSupport();
+  E.frame_bytes = 0;
+  E.frame_time = 0;
+  E.total_bytes = 0;
+  memset(E.stats, 0, sizeof(E.stats));
+  E.stats_overlay = 0;
+  E.readonly = 0;
+  E.stats_file = getenv("LEXI_STATS");
+  if (E.stats_file)
+    atexit(statDump);
 }
+#ifndef LEXI_BENCH
 int main(int argc, char *argv[])
 {
-  enableRawMode();
-  initEditor();
-  if (argc >= 2)
+  int follow = 0, readonly = 0, opt;
+  while ((opt = getopt(argc, argv, "fR")) != -1)
   {
-    editorOpen(argv[1]);
+    if (opt == 'f') // lexi -f FILE follows it from the start
+      follow = 1;
+    else if (opt == 'R') // lexi -R pages through a file or a pipe without editing it
+      readonly = 1;
+    else
+    {
+      fprintf(stderr, "usage: lexi [-f] [-R] [FILE | -]\n");
+      return 1;
+    }
   }
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-E = quit | Ctrl-F = find");
+  char *name = optind < argc ? argv[optind] : NULL;
+  int input = -1;
+  if (name ? strcmp(name, "-") == 0 : !isatty(STDIN_FILENO)) // cmd | lexi -
+    input = editorTakeStdin();
+  enableRawMode();
+  initEditor();
+  E.readonly = readonly;
+  if (readonly)
+    editorSetStatusMessage("HELP: q = quit | Space/b = page | / = find | Ctrl-G = go to");
+  else
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-E = quit | Ctrl-F = find | Ctrl-G = go to");
+  E.follow.on = follow && input == -1; // so editorOpen reads the file instead of mapping it
+  if (input != -1)
+    editorOpenStream(input);
+  else if (name)
+    editorOpen(name);
+  if (follow)
+    followStart();
   while (1)
   {
     editorRefreshScreen(); //
     editorProcessKeypress();
-    char c = '\0';
-    if (read(STDIN_FILENO, &c, 1) == -1 && errno != EAGAIN)
-      die("read");
-    if (iscntrl(c)) // check if character is a control character
+    editorProcessPending();
+  }
+
+  return 0;
+}
+#endif
+
+/*** bench ***/
+
+#ifdef LEXI_BENCH
+
+// A headless build (make lexi-bench) that opens a generated or given file,
+// replays a keystroke script through editorProcessKeypress one frame per
+// key with the screen going to /dev/null, saves, and prints one line of
+// JSON with the timings, allocation counts and bytes of output. With -t it
+// runs its checks instead (make check) and fails if any does not hold.
+//
+//   lexi-bench [-r rows] [-c cols] [-k keyfile] 1k|1m|10m|long|tabs|FILE
+//   lexi-bench -t
+
+#define LEXI_BENCH_KEYS                                             \
+  "\x1b[6~\x1b[6~\x1b[6~\x1b[6~\x1b[6~\x1b[6~\x1b[6~\x1b[6~"         \
+  "\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[C\x1b[C"     \
+  "the quick brown fox \rjumps over \r\t\tthe lazy dog\r"            \
+  "\x7f\x7f\x7f\x7f\x7f\x7f\x1b[F\x1b[H\x1b[A\x1b[A\x1b[A\x1b[D"     \
+  "\x06fox\r\x1b[C\x1b[Cxyz\x7f\x06dog\x1b[B\x1b[B\x1b[A\r"          \
+  "\x1b[5~\x1b[5~\x1b[5~\x1b[6~\x1b[6~\x1b[F\x1b[3~\x1b[3~\x1b[3~"
+
+long long benchNow() // monotonic clock in us
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void benchKey() // a key is being read: closes the sample of the key before it and starts a new one
+{
+  long long now = benchNow();
+  if (Bench.keystart)
+  {
+    if (Bench.nlat == Bench.latcap)
     {
-      printf("%d\r\n", c);
+      Bench.latcap = Bench.latcap ? Bench.latcap * 2 : 1024;
+      Bench.lat = realloc(Bench.lat, sizeof(long long) * Bench.latcap);
+      if (Bench.lat == NULL)
+        die("realloc");
     }
+    Bench.lat[Bench.nlat++] = now - Bench.keystart;
+  }
+  Bench.keystart = now;
+}
+
+void benchPutString(FILE *out, const char *s) // writes s as a JSON string
+{
+  fputc('"', out);
+  for (; *s; s++)
+  {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', out);
+    if ((unsigned char)*s < 0x20)
+      fprintf(out, "\\u%04x", *s);
     else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+int benchCmp(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+long long benchPercentile(double p)
+{
+  if (Bench.nlat == 0)
+    return 0;
+  int i = (int)(p * (Bench.nlat - 1) + 0.5);
+  return Bench.lat[i];
+}
+
+void benchGenerate(const char *kind, const char *path) // writes one of the stock inputs
+{
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    die("fopen");
+  long i, n;
+  if (strcmp(kind, "long") == 0)
+  {
+    for (i = 0; i < 1000; i++) // 1000 lines of 20000 characters
     {
-      printf("%d ('%c')\r\n", c, c);
+      long j;
+      for (j = 0; j < 2000; j++)
+        fprintf(fp, "%09ld ", (i * 2000 + j) % 1000000000);
+      fputc('\n', fp);
     }
-    if (c == CTRL_KEY('e'))
+  }
+  else if (strcmp(kind, "tabs") == 0)
+  {
+    for (i = 0; i < 250000; i++) // a million lines indented with tabs
+      fprintf(fp, "if (x%ld)\n{\n\tfor (;;)\n\t\t\tfoo(%ld);\t\t// the quick brown fox\n", i, i);
+  }
+  else
+  {
+    if (strcmp(kind, "1k") == 0)
+      n = 1000;
+    else if (strcmp(kind, "1m") == 0)
+      n = 1000000;
+    else if (strcmp(kind, "10m") == 0)
+      n = 10000000;
+    else
+      die("bench input");
+    for (i = 0; i < n; i++)
+      fprintf(fp, "%ld the quick brown fox jumps over the lazy dog\n", i);
+  }
+  if (fclose(fp) == EOF)
+    die("fclose");
+}
+
+char *benchReadFile(const char *path, int *len)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    die("fopen");
+  size_t cap = 4096, n = 0, got;
+  char *buf = malloc(cap);
+  while (buf && (got = fread(buf + n, 1, cap - n, fp)) > 0)
+  {
+    n += got;
+    if (n == cap)
+      buf = realloc(buf, cap *= 2);
+  }
+  if (buf == NULL)
+    die("malloc");
+  fclose(fp);
+  *len = n;
+  return buf;
+}
+
+int benchCheckRegex(const char *pattern, const char *line, const char *want)
+{
+  // runs a pattern over a line like a search does, `want` lists the matches
+  // as "start-end start-end"; returns 1 if it holds
+  const char *err;
+  struct regex *re = regexCompile(pattern, &err);
+  char got[256] = "";
+  int len = 0;
+  if (re == NULL)
+  {
+    fprintf(stderr, "regex %s: %s\n", pattern, err);
+    return 0;
+  }
+  long long from = 0, start, end;
+  while (regexMatch(re, 0, line, strlen(line), from, &start, &end) && len < (int)sizeof(got) - 48)
+  {
+    len += snprintf(got + len, sizeof(got) - len, "%s%lld-%lld", len ? " " : "", start, end);
+    from = end;
+  }
+  regexFree(re);
+  if (strcmp(got, want) == 0)
+    return 1;
+  fprintf(stderr, "regex %s on \"%s\": got \"%s\", want \"%s\"\n", pattern, line, got, want);
+  return 0;
+}
+
+int benchCheckFrame(const char *old, const char *new, const char *want)
+{
+  // draws a one row screen showing `old` as `new` with the cursor on the row's
+  // first cell, `want` is what has to go to the terminal; returns 1 if it does
+  struct append_buffer ab;
+  int fds[2];
+  char got[256];
+  abInit(&ab, 64, 8);
+  frameAlloc(&E.frame, 1, 16);
+  frameClear(&E.frame);
+  frameWrite(0, 0, old, strlen(old), ATTR_NORMAL);
+  E.shadow = E.frame;
+  frameAlloc(&E.frame, 1, 16);
+  frameClear(&E.frame);
+  frameWrite(0, 0, new, strlen(new), ATTR_NORMAL);
+  E.shadow_valid = 1;
+  E.term_cy = E.term_cx = 0;
+  frameFlush(&ab);
+  if (pipe(fds) == -1)
+    die("pipe");
+  abWrite(&ab, fds[1]);
+  close(fds[1]);
+  int len = read(fds[0], got, sizeof(got) - 1);
+  close(fds[0]);
+  got[len < 0 ? 0 : len] = '\0';
+  free(E.frame.chars);
+  free(E.frame.attrs);
+  free(E.shadow.chars);
+  free(E.shadow.attrs);
+  free(ab.b);
+  free(ab.iov);
+  if (strcmp(got, want) == 0)
+    return 1;
+  fprintf(stderr, "frame \"%s\" to \"%s\": got ", old, new);
+  benchPutString(stderr, got);
+  fprintf(stderr, ", want ");
+  benchPutString(stderr, want);
+  fputc('\n', stderr);
+  return 0;
+}
+
+int benchCheck()
+{
+  int ok = 1;
+  ok &= benchCheckRegex("abcd|bc", "abcd xx abcd", "0-4 8-12"); // the leftmost start wins over the first end
+  ok &= benchCheckRegex("bc|abcd", "xabcd bc", "1-5 6-8");
+  ok &= benchCheckRegex("a|ab", "ab ab", "0-2 3-5");   // then the longest end
+  ok &= benchCheckRegex("b|abc", "abc", "0-3");
+  ok &= benchCheckRegex("^b|ab", "ab b", "0-2");
+  ok &= benchCheckRegex("c$|abc", "abc abc", "0-3 4-7");
+  ok &= benchCheckRegex("x*", "aaa", "");              // empty matches are not found
+  ok &= benchCheckRegex("a.*b|c", "ccab", "0-1 1-2 2-4");
+  ok &= benchCheckFrame("hello world", "hello worldX", "\x1b[11CX");                      // only the changed cell
+  ok &= benchCheckFrame("h\xc3\xa9llo w\xc3\xb6rld", "h\xc3\xa9llo w\xc3\xb6rldX", // multibyte rows are drawn whole
+                        "h\xc3\xa9llo w\xc3\xb6rldX\x1b[K");
+  ok &= benchCheckFrame("w\xc3\xb6rld", "world", "world\x1b[K");
+  fprintf(stderr, "lexi-bench: checks %s\n", ok ? "passed" : "failed");
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *keyfile = NULL;
+  int opt;
+  Bench.rows = 24;
+  Bench.cols = 80;
+  while ((opt = getopt(argc, argv, "r:c:k:t")) != -1)
+  {
+    if (opt == 't')
+      return benchCheck();
+    else if (opt == 'r')
+      Bench.rows = atoi(optarg);
+    else if (opt == 'c')
+      Bench.cols = atoi(optarg);
+    else if (opt == 'k')
+      keyfile = optarg;
+    else
       break;
   }
+  if (optind != argc - 1 || Bench.rows < 3 || Bench.cols < 1)
+  {
+    fprintf(stderr, "usage: lexi-bench [-r rows] [-c cols] [-k keyfile] 1k|1m|10m|long|tabs|FILE | -t\n");
+    return 1;
+  }
+  const char *input = argv[optind];
+  const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char genpath[PATH_MAX], savepath[PATH_MAX];
+  snprintf(genpath, sizeof(genpath), "%s/lexi-bench-%d.txt", tmp, (int)getpid());
+  snprintf(savepath, sizeof(savepath), "%s/lexi-bench-%d.save", tmp, (int)getpid());
+  const char *path = input;
+  struct stat st;
+  if (stat(input, &st) == -1) // not a file, so the name of a stock input
+  {
+    benchGenerate(input, genpath);
+    path = genpath;
+    if (stat(path, &st) == -1)
+      die("stat");
+  }
+
+  int report = dup(STDOUT_FILENO); // the screen goes to a null terminal, the report to the real stdout
+  int null = open("/dev/null", O_WRONLY);
+  if (report == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1)
+    die("dup");
+  close(null);
+  initEditor();
+
+  long long t0 = benchNow();
+  editorOpen((char *)path);
+  long long t1 = benchNow();
+  editorIndexAll();
+  long long t2 = benchNow();
+  if (keyfile)
+  {
+    E.input = benchReadFile(keyfile, &E.inputlen);
+  }
+  else
+  {
+    E.input = strdup(LEXI_BENCH_KEYS);
+    E.inputlen = strlen(E.input);
+  }
+  E.inputpos = 0;
+  int nkeys = E.inputlen;
+  long long bytes0 = E.total_bytes;
+  while (E.inputpos < E.inputlen) // one frame per key, so each key pays for its own redraw
+  {
+    editorRefreshScreen();
+    editorProcessKeypress();
+  }
+  editorRefreshScreen();
+  benchKey();
+  long long t3 = benchNow();
+  free(E.filename);
+  E.filename = strdup(savepath);
+  editorSave();
+  long long t4 = benchNow();
+  unlink(savepath);
+  if (path == genpath)
+    unlink(genpath);
 
+  qsort(Bench.lat, Bench.nlat, sizeof(long long), benchCmp);
+  FILE *out = fdopen(report, "w");
+  if (out == NULL)
+    die("fdopen");
+  fprintf(out, "{\"input\": ");
+  benchPutString(out, input);
+  fprintf(out, ", \"lines\": %lld, \"bytes\": %lld, \"screen\": [%d, %d], ",
+          E.numrows, (long long)st.st_size, Bench.rows, Bench.cols);
+  fprintf(out, "\"open_us\": %lld, \"index_us\": %lld, \"replay_us\": %lld, \"save_us\": %lld, ",
+          t1 - t0, t2 - t1, t3 - t2, t4 - t3);
+  fprintf(out, "\"key_bytes\": %d, \"keys\": %d, \"key_us\": {\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"max\": %lld}, ",
+          nkeys, Bench.nlat, benchPercentile(0.5), benchPercentile(0.9), benchPercentile(0.99),
+          Bench.nlat ? Bench.lat[Bench.nlat - 1] : 0);
+  fprintf(out, "\"output_bytes\": %lld, \"frames\": %lld, ", E.total_bytes - bytes0, E.alloc.ops[ALLOC_FRAME]);
+  fprintf(out, "\"allocs\": {\"load\": [%lld, %lld], \"edit\": [%lld, %lld], \"frame\": [%lld, %lld]}}\n",
+          E.alloc.calls[ALLOC_LOAD], E.alloc.ops[ALLOC_LOAD], E.alloc.calls[ALLOC_EDIT], E.alloc.ops[ALLOC_EDIT],
+          E.alloc.calls[ALLOC_FRAME], E.alloc.ops[ALLOC_FRAME]);
+  fclose(out);
   return 0;
 }
+
+#endif